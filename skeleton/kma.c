@@ -61,10 +61,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_trace.h"
+#include "kma_tcache.h"
+#include "kma_lfstack.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -87,10 +97,69 @@ typedef struct mem
   enum REQ_STATE state;
 } mem_t;
 
+// the thread cache and the buddy arenas may be called from any thread,
+// the other allocators are called under the replay lock
+#if defined(KMA_TCACHE) || defined(BUD_ARENAS)
+#define REPLAY_THREAD_SAFE
+#endif
+
+#define MAX_THREADS 256
+
+// a trace line kept in memory for the threaded replay
+typedef struct
+{
+  int free;
+  int id;
+  int size;
+} replay_cmd_t;
+
+typedef struct
+{
+  replay_cmd_t* cmds;
+  int n_cmds;
+  int n_req;
+} replay_trace_t;
+
+// a block one thread hands to another to free
+typedef struct
+{
+  kma_lfnode_t link;
+  void* ptr;
+  int size;
+  int id;
+} replay_msg_t;
+
+typedef struct
+{
+  int index;
+  replay_cmd_t* cmds;   // the thread's share of its trace
+  int n_cmds;
+  mem_t* requests;
+  kma_lfstack_t inbox;
+  long* latency;        // nanoseconds of each kma_malloc and kma_free
+  int n_latency;
+  int max_latency;
+  int sent;             // frees handed to other threads
+  long start;
+  long end;
+  unsigned int seed;
+  pthread_t tid;
+} replay_worker_t;
+
 /************Global Variables*********************************************/
 
 static int val = 0;
 
+static replay_worker_t* workers = NULL;
+static int numWorkers = 0;
+static double crossRatio = 0.0;
+static pthread_barrier_t replayBarrier;
+static int replayMismatches = 0;
+
+#ifndef REPLAY_THREAD_SAFE
+static pthread_mutex_t replayLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /************Function Prototypes******************************************/
 void allocate();
 void deallocate();
@@ -100,6 +169,21 @@ void usage();
 void error(char*, char*);
 void pass();
 void fail();
+int openTlbCounter();
+long readTlbCounter(int);
+void replayThreads(int, char**, int);
+void readTrace(char*, replay_trace_t*);
+void* replayWorker(void*);
+void replayMalloc(replay_worker_t*, mem_t*, int, int);
+void replayFree(replay_worker_t*, mem_t*);
+void replayBlock(replay_worker_t*, void*, int, int);
+void replayInbox(replay_worker_t*);
+void recordLatency(replay_worker_t*, long);
+void stamp(char*, int, int);
+int stampOk(char*, int, int);
+long now();
+int compareLong(const void*, const void*);
+void printLatency(long*, int);
 
 /************External Declaration*****************************************/
 
@@ -133,6 +217,33 @@ main(int argc, char* argv[])
   
   name = argv[0];
   
+  int threads = 0, opt;
+
+  while ((opt = getopt(argc, argv, "t:x:")) != -1)
+    {
+      switch (opt)
+	{
+	case 't':
+	  threads = atoi(optarg);
+	  break;
+	case 'x':
+	  crossRatio = atof(optarg);
+	  break;
+	default:
+	  usage();
+	}
+    }
+
+  if (threads > 0)
+    {
+      if (optind >= argc || threads > MAX_THREADS
+	  || crossRatio < 0.0 || crossRatio > 1.0)
+	{
+	  usage();
+	}
+      replayThreads(threads, argv + optind, argc - optind);
+    }
+
 #ifdef COMPETITION
   printf("%s: Running in competition mode\n", name);
 #endif
@@ -158,15 +269,15 @@ main(int argc, char* argv[])
   fprintf(allocTrace, "0 0 0\n");
 #endif
 
-  if (argc != 2)
+  if (argc - optind != 1)
     {
       usage();
     }
   
-  FILE* f_test = fopen(argv[1], "r");
+  FILE* f_test = fopen(argv[optind], "r");
   if (f_test == NULL)
     {
-      error("unable to open input test file", argv[1]);
+      error("unable to open input test file", argv[optind]);
     }
   
   // Get the number of requests in the trace file
@@ -180,6 +291,13 @@ main(int argc, char* argv[])
   
   char command[16];
   int req_id, req_size, index = 1;
+  
+  // page faults and TLB misses of the replay, the counter is not
+  // available everywhere. both count the harness's fill and check loops
+  // as well as the allocator
+  struct rusage usageStart, usageEnd;
+  int tlbCounter = openTlbCounter();
+  getrusage(RUSAGE_SELF, &usageStart);
 
   // Parse the lines in the file, and call allocate or
   // deallocate accordingly.
@@ -233,15 +351,32 @@ main(int argc, char* argv[])
       index += 1;
     }
 
+  getrusage(RUSAGE_SELF, &usageEnd);
+  long tlbMisses = readTlbCounter(tlbCounter);
+  
 #ifndef COMPETITION
   fclose(allocTrace);
 #endif
   
   
+#ifdef KMA_TCACHE
+  // blocks the cache still holds keep their pages in use
+  kma_tcache_flush();
+#endif
+  
   stat = page_stats();
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Page Released Bytes: %ld\n", stat->bytes_released);
+  printf("Page Faults Minor/Major: %ld/%ld\n",
+	 usageEnd.ru_minflt - usageStart.ru_minflt,
+	 usageEnd.ru_majflt - usageStart.ru_majflt);
+  if (tlbMisses >= 0)
+    printf("dTLB Load Misses (whole replay, harness included): %ld\n",
+	   tlbMisses);
+  else
+    printf("dTLB Load Misses (whole replay, harness included): n/a\n");
 	 
 	 malloc_avg = malloc_avg / mallocRequests;
 	 
@@ -266,6 +401,11 @@ main(int argc, char* argv[])
 #ifdef COMPETITION
   printf("Competition average ratio: %f\n", ratioSum / ratioCount);
 #endif
+
+#ifdef KMA_TRACE
+  printf("Trace records written to %s: %d\n", KMA_TRACE_FILE,
+	 kma_trace_dump(KMA_TRACE_FILE));
+#endif
   
   pass();
   return 0;
@@ -285,9 +425,48 @@ pass()
   exit(0);
 }
 
+int
+openTlbCounter()
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // count the replay threads started after this as well
+  attr.inherit = 1;
+  
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+long
+readTlbCounter(int fd)
+{
+  long long count;
+  
+  if (fd < 0)
+    return -1;
+  
+  if (read(fd, &count, sizeof(count)) != sizeof(count))
+    count = -1;
+  close(fd);
+  return count;
+}
+
 void
 usage() {
   printf("Usage: %s traceFile\n", name);
+  printf("       %s -t threads [-x crossFreeRatio] traceFile [traceFile...]\n",
+	 name);
   exit(0);
 }
 
@@ -316,17 +495,13 @@ allocate(mem_t* requests, int req_id, int req_size)
     malloc_worst = cpu_time_malloc;
   }
   mallocRequests++;
+  TRACE(TRACE_MALLOC, new->ptr, new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
-    {
-      error("got NULL from kma_malloc for alloc'able request", "");
-    }
-  
+  // Requests larger than a page get a run of pages, so a NULL
+  // response is never acceptable
   if (new->ptr == NULL)
     {
-      return;
+      error("got NULL from kma_malloc for alloc'able request", "");
     }
 
   currentAllocBytes += req_size;
@@ -369,6 +544,7 @@ deallocate(mem_t* requests, int req_id)
   free(cur->value);
 #endif
 
+  TRACE(TRACE_FREE, cur->ptr, cur->size);
   startFree = clock();
   kma_free(cur->ptr, cur->size);
   endFree = clock();
@@ -414,3 +590,418 @@ check(char* lhs, char* rhs, int size)
 	}
     }
 }
+
+void
+replayThreads(int threads, char* files[], int n_files)
+{
+  replay_trace_t* traces = malloc(n_files * sizeof(replay_trace_t));
+  long* latency;
+  long start, end;
+  int i, t, f, ops = 0, sent = 0, n_latency = 0;
+  kma_page_stat_t* stat;
+
+  printf("%s: Replaying %d trace(s) on %d threads, cross-thread free ratio %g\n",
+	 name, n_files, threads, crossRatio);
+#ifndef REPLAY_THREAD_SAFE
+  printf("%s: Allocator is not thread-safe, calls are serialised\n", name);
+#endif
+
+  for (i = 0; i < n_files; i++)
+    {
+      readTrace(files[i], &traces[i]);
+    }
+
+  // a single trace is dealt out by request id, so every request is
+  // allocated and freed by the same thread. several traces are dealt
+  // out round robin and a thread replays its traces one after another,
+  // the request ids of each following the ones before
+  numWorkers = threads;
+  workers = calloc(threads, sizeof(replay_worker_t));
+  for (t = 0; t < threads; t++)
+    {
+      replay_worker_t* w = &workers[t];
+      int n_cmds = 0, n_req = 0;
+
+      for (f = t % n_files; f < n_files; f += threads)
+	{
+	  n_cmds += traces[f].n_cmds;
+	}
+
+      w->index = t;
+      w->cmds = malloc(n_cmds * sizeof(replay_cmd_t));
+      for (f = t % n_files; f < n_files; f += threads)
+	{
+	  replay_trace_t* trace = &traces[f];
+
+	  for (i = 0; i < trace->n_cmds; i++)
+	    {
+	      if (n_files > 1 || trace->cmds[i].id % threads == t)
+		{
+		  w->cmds[w->n_cmds] = trace->cmds[i];
+		  w->cmds[w->n_cmds++].id += n_req;
+		}
+	    }
+	  n_req += trace->n_req;
+	}
+      w->requests = calloc(n_req, sizeof(mem_t));
+      w->inbox = (kma_lfstack_t) LFSTACK_INIT;
+      w->max_latency = w->n_cmds + 64;
+      w->latency = malloc(w->max_latency * sizeof(long));
+      w->seed = t + 1;
+      if (w->requests == NULL || w->latency == NULL)
+	{
+	  error("unable to allocate the replay state", "");
+	}
+    }
+
+  struct rusage usageStart, usageEnd;
+  int tlbCounter = openTlbCounter();
+  getrusage(RUSAGE_SELF, &usageStart);
+
+  pthread_barrier_init(&replayBarrier, NULL, threads);
+  for (t = 0; t < threads; t++)
+    {
+      if (pthread_create(&workers[t].tid, NULL, replayWorker, &workers[t]) != 0)
+	{
+	  error("unable to start a replay thread", "");
+	}
+    }
+  for (t = 0; t < threads; t++)
+    {
+      pthread_join(workers[t].tid, NULL);
+    }
+  pthread_barrier_destroy(&replayBarrier);
+
+  getrusage(RUSAGE_SELF, &usageEnd);
+  long tlbMisses = readTlbCounter(tlbCounter);
+
+  // ops are the trace lines a thread replayed, a free handed to another
+  // thread counts for the sender and its latency for the one freeing it
+  start = workers[0].start;
+  end = workers[0].end;
+  for (t = 0; t < threads; t++)
+    {
+      replay_worker_t* w = &workers[t];
+      double seconds = (w->end - w->start) / 1e9;
+
+      if (w->start < start)
+	start = w->start;
+      if (w->end > end)
+	end = w->end;
+      ops += w->n_cmds;
+      sent += w->sent;
+      n_latency += w->n_latency;
+
+      printf("Thread %3d: %8d ops %10.0f ops/sec, latency ",
+	     t, w->n_cmds, seconds > 0 ? w->n_cmds / seconds : 0.0);
+      printLatency(w->latency, w->n_latency);
+    }
+
+  latency = malloc((n_latency + 1) * sizeof(long));
+  n_latency = 0;
+  for (t = 0; t < threads; t++)
+    {
+      memcpy(latency + n_latency, workers[t].latency,
+	     workers[t].n_latency * sizeof(long));
+      n_latency += workers[t].n_latency;
+    }
+  printf("All threads: %8d ops %10.0f ops/sec, latency ",
+	 ops, end > start ? ops / ((end - start) / 1e9) : 0.0);
+  printLatency(latency, n_latency);
+  printf("Cross-thread frees: %d\n", sent);
+
+#ifdef KMA_TCACHE
+  // the replay threads gave their caches back when they exited
+  kma_tcache_flush();
+#endif
+
+  stat = page_stats();
+
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+	 stat->num_requested, stat->num_freed, stat->num_in_use);
+  printf("Page Released Bytes: %ld\n", stat->bytes_released);
+  printf("Page Faults Minor/Major: %ld/%ld\n",
+	 usageEnd.ru_minflt - usageStart.ru_minflt,
+	 usageEnd.ru_majflt - usageStart.ru_majflt);
+  if (tlbMisses >= 0)
+    printf("dTLB Load Misses (whole replay, harness included): %ld\n",
+	   tlbMisses);
+  else
+    printf("dTLB Load Misses (whole replay, harness included): n/a\n");
+
+  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+
+  if (replayMismatches)
+    {
+      error("there were memory mismatches", "");
+    }
+
+#ifdef KMA_TRACE
+  printf("Trace records written to %s: %d\n", KMA_TRACE_FILE,
+	 kma_trace_dump(KMA_TRACE_FILE));
+#endif
+
+  pass();
+}
+
+void
+readTrace(char* file, replay_trace_t* trace)
+{
+  char command[16];
+  int max_cmds = 1024;
+  FILE* f_test = fopen(file, "r");
+
+  if (f_test == NULL)
+    {
+      error("unable to open input test file", file);
+    }
+
+  if (fscanf(f_test, "%d\n", &trace->n_req) != 1)
+    error("Couldn't read number of requests at head of file", file);
+
+  trace->n_cmds = 0;
+  trace->cmds = malloc(max_cmds * sizeof(replay_cmd_t));
+  while (fscanf(f_test, "%10s", command) == 1)
+    {
+      replay_cmd_t* cmd;
+
+      if (trace->n_cmds == max_cmds)
+	{
+	  max_cmds *= 2;
+	  trace->cmds = realloc(trace->cmds, max_cmds * sizeof(replay_cmd_t));
+	}
+      if (trace->cmds == NULL)
+	{
+	  error("unable to allocate the trace", file);
+	}
+      cmd = &trace->cmds[trace->n_cmds++];
+
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  if (fscanf(f_test, "%d %d", &cmd->id, &cmd->size) != 2)
+	    error("Not enough arguments to REQUEST", "");
+	  cmd->free = 0;
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  if (fscanf(f_test, "%d", &cmd->id) != 1)
+	    error("Not enough arguments to FREE", "");
+	  cmd->free = 1;
+	}
+      else
+	{
+	  error("unknown command type:", command);
+	}
+
+      assert(cmd->id >= 0 && cmd->id < trace->n_req);
+    }
+
+  fclose(f_test);
+}
+
+void*
+replayWorker(void* arg)
+{
+  replay_worker_t* w = arg;
+  int i;
+
+  pthread_barrier_wait(&replayBarrier);
+  w->start = now();
+  for (i = 0; i < w->n_cmds; i++)
+    {
+      replay_cmd_t* cmd = &w->cmds[i];
+
+      if (cmd->free)
+	{
+	  replayFree(w, &w->requests[cmd->id]);
+	}
+      else
+	{
+	  replayMalloc(w, &w->requests[cmd->id], cmd->id, cmd->size);
+	}
+      replayInbox(w);
+    }
+  w->end = now();
+
+  // blocks handed over after their new owner finished are freed once
+  // everyone is through the trace. frees the allocator defers between
+  // threads must settle on their own before the page check
+  pthread_barrier_wait(&replayBarrier);
+  replayInbox(w);
+
+  return NULL;
+}
+
+void
+replayMalloc(replay_worker_t* w, mem_t* req, int req_id, int req_size)
+{
+  long start;
+
+  assert(req->state == FREE);
+
+  start = now();
+#ifndef REPLAY_THREAD_SAFE
+  pthread_mutex_lock(&replayLock);
+#endif
+  req->ptr = kma_malloc(req_size);
+#ifndef REPLAY_THREAD_SAFE
+  pthread_mutex_unlock(&replayLock);
+#endif
+  recordLatency(w, now() - start);
+  TRACE(TRACE_MALLOC, req->ptr, req_size);
+
+  if (req->ptr == NULL)
+    {
+      error("got NULL from kma_malloc for alloc'able request", "");
+    }
+
+  req->size = req_size;
+  req->value = (void*)(long) req_id;
+  req->state = USED;
+  stamp((char*)req->ptr, req_size, req_id);
+}
+
+void
+replayFree(replay_worker_t* w, mem_t* req)
+{
+  int id = (int)(long) req->value;
+
+  assert(req->state == USED);
+  req->state = FREE;
+
+  if (numWorkers > 1
+      && rand_r(&w->seed) % 10000 < crossRatio * 10000)
+    {
+      // the block goes to a random other thread
+      int to = (w->index + 1 + rand_r(&w->seed) % (numWorkers - 1)) % numWorkers;
+      replay_msg_t* msg = malloc(sizeof(replay_msg_t));
+
+      if (msg == NULL)
+	{
+	  error("unable to allocate a replay message", "");
+	}
+      msg->ptr = req->ptr;
+      msg->size = req->size;
+      msg->id = id;
+      lfstack_push(&workers[to].inbox, &msg->link);
+      w->sent++;
+      return;
+    }
+
+  replayBlock(w, req->ptr, req->size, id);
+}
+
+void
+replayBlock(replay_worker_t* w, void* ptr, int size, int req_id)
+{
+  long start;
+
+  if (!stampOk((char*)ptr, size, req_id))
+    {
+      fprintf(stderr, "memory mismatch in request %d\n", req_id);
+      __atomic_store_n(&replayMismatches, 1, __ATOMIC_RELAXED);
+    }
+
+  TRACE(TRACE_FREE, ptr, size);
+  start = now();
+#ifndef REPLAY_THREAD_SAFE
+  pthread_mutex_lock(&replayLock);
+#endif
+  kma_free(ptr, size);
+#ifndef REPLAY_THREAD_SAFE
+  pthread_mutex_unlock(&replayLock);
+#endif
+  recordLatency(w, now() - start);
+}
+
+void
+replayInbox(replay_worker_t* w)
+{
+  kma_lfnode_t* node;
+
+  // an empty inbox costs a load, not an exchange
+  if (LFSTACK_PTR(__atomic_load_n(&w->inbox.top, __ATOMIC_RELAXED)) == NULL)
+    {
+      return;
+    }
+
+  node = lfstack_pop_all(&w->inbox);
+  while (node != NULL)
+    {
+      replay_msg_t* msg = (replay_msg_t*) node;
+
+      node = node->next;
+      replayBlock(w, msg->ptr, msg->size, msg->id);
+      free(msg);
+    }
+}
+
+void
+recordLatency(replay_worker_t* w, long ns)
+{
+  if (w->n_latency == w->max_latency)
+    {
+      w->max_latency *= 2;
+      w->latency = realloc(w->latency, w->max_latency * sizeof(long));
+      if (w->latency == NULL)
+	{
+	  error("unable to allocate the latency samples", "");
+	}
+    }
+  w->latency[w->n_latency++] = ns;
+}
+
+void
+stamp(char* ptr, int size, int req_id)
+{
+  char tag = (char)(req_id ^ (req_id >> 8) ^ (req_id >> 16));
+
+  // the first, middle and last byte are enough to notice blocks that
+  // overlap without slowing the replay down
+  ptr[0] = tag;
+  ptr[size / 2] = tag;
+  ptr[size - 1] = tag;
+}
+
+int
+stampOk(char* ptr, int size, int req_id)
+{
+  char tag = (char)(req_id ^ (req_id >> 8) ^ (req_id >> 16));
+
+  return ptr[0] == tag && ptr[size / 2] == tag && ptr[size - 1] == tag;
+}
+
+long
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int
+compareLong(const void* a, const void* b)
+{
+  long lhs = *(const long*) a, rhs = *(const long*) b;
+
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+void
+printLatency(long* latency, int n)
+{
+  if (n == 0)
+    {
+      printf("p50/p99/p99.9/max: -/-/-/- ns\n");
+      return;
+    }
+
+  qsort(latency, n, sizeof(long), compareLong);
+  printf("p50/p99/p99.9/max: %ld/%ld/%ld/%ld ns\n",
+	 latency[(long) n * 50 / 100], latency[(long) n * 99 / 100],
+	 latency[(long) n * 999 / 1000], latency[n - 1]);
+}
@@ -46,10 +46,13 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_lfstack.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -61,6 +64,8 @@
 #define MIN_SIZE 32
 #define PAGE_SIZE 8192
 #define NODE_SIZE 12
+//how many page nodes fit in a bookkeeping page after its header
+#define PAGENODES_PER_PAGE ((int)((PAGE_SIZE - sizeof(pageheader)) / sizeof(pagenode)))
 
 typedef struct list_head
 {
@@ -84,6 +89,67 @@ typedef struct page_node
     //bitmap struct???
 } pagenode;
 
+//BUD_ARENAS=n splits the intrusive lists into n arenas, one per group of
+//threads. it only exists on top of the intrusive lists
+#if defined(BUD_ARENAS) && !defined(BUD_INTRUSIVE)
+#define BUD_INTRUSIVE
+#endif
+
+
+#ifdef BUD_INTRUSIVE
+//with BUD_INTRUSIVE a free block links itself into the free list of its
+//size, so there are no LISTS pages and no block nodes to compact
+typedef struct free_block
+{
+    void* next;
+    void* prev;
+} freeblock;
+
+//free lists for sizes 32 up to 4096, a whole page never sits in a list
+#define NUM_LISTS 8
+
+#ifdef BUD_ARENAS
+//a block freed by a thread of another arena, on its way to the remote
+//free queue of the arena that owns its page
+typedef struct remote_block
+{
+    kma_lfnode_t link;
+    kma_size_t size;
+} remoteblock;
+
+//foreign frees a thread collects for one arena before it hands them
+//over with a single push
+#define REMOTE_BATCH 32
+
+typedef struct remote_batch
+{
+    remoteblock* first;
+    remoteblock* last;
+    int count;
+} remotebatch;
+
+#define ARENA_LOCK(a) pthread_mutex_lock(&(a)->lock)
+#define ARENA_UNLOCK(a) unlock_arena(a)
+#else
+#define ARENA_LOCK(a) ((void)0)
+#define ARENA_UNLOCK(a) ((void)0)
+#endif
+
+//the free lists of one arena, there is just one without BUD_ARENAS
+typedef struct bud_arena
+{
+    //heads of the intrusive free lists
+    freeblock* freeLists[NUM_LISTS];
+    //bit i is set while freeLists[i] is not empty
+    unsigned int freeMask;
+#ifdef BUD_ARENAS
+    pthread_mutex_t lock;
+    //batches pushed without the lock by other arenas, taken all at once
+    //by whoever holds the lock next, see unlock_arena()
+    kma_lfstack_t remoteFrees;
+#endif
+} budarena;
+#endif
 
 typedef enum 
 {
@@ -109,6 +175,35 @@ typedef struct page_head
 kma_page_t* globalPtr = NULL;
 //int requestNumber = 0;
 
+//bit i is set while the list of size MIN_SIZE << i (ptrs[i] of the
+//bookkeeping page) is not empty
+unsigned int listMask = 0;
+
+#ifdef BUD_INTRUSIVE
+#ifdef BUD_ARENAS
+budarena arenas[BUD_ARENAS];
+
+//arena of the calling thread, threads are spread round robin
+__thread int myArena = -1;
+int nextArena = 0;
+
+//foreign frees of the calling thread not handed over yet, per arena.
+//they go out when a batch is full, when the thread mallocs or frees into
+//its own arena and when it exits
+__thread remotebatch pendingFrees[BUD_ARENAS];
+__thread int pendingCount = 0;
+pthread_key_t pendingKey;
+#else
+budarena theArena;
+#endif
+
+//page node (bitmap) of every page of the pool, indexed by page number.
+//these are registered as page owners, so update_bitmap and findBuddy
+//work the same as with the page node lists. sized from the pool on first use
+pagenode* pageNodes = NULL;
+pthread_once_t budOnce = PTHREAD_ONCE_INIT;
+#endif
+
 /************Function Prototypes******************************************/
 void initialize_books();
 void allocate_new_page();
@@ -119,31 +214,58 @@ int getListIndex(kma_size_t size);
 kma_size_t adjustSize(kma_size_t num);
 blocknode* split_free_to_size(kma_size_t size, blocknode* node);
 void remove_from_list(blocknode* node);
+void free_list_tail(blocknode* tail);
 void fix_pointers();
 blocknode* add_to_list(void* ptr,kma_size_t size, kma_page_t* pagePtr);
 void coalesce_blocks(void* ptr,kma_size_t size, int fromRecursion);
 blocknode* findBlock(void* ptr, kma_size_t size);
 int findBuddy(void* buddyAddr,kma_size_t size);
-void free_pages();
+void free_books();
 void* findPagePtr(void* ptr);
 void remove_from_pagelist(void* pagePtr);
 void addPageNode(void* ptr,void* pagePtr);
 void* findPagePtr(void* ptr);
+#ifdef BUD_INTRUSIVE
+void init_arenas();
+budarena* thread_arena();
+void free_block(budarena* arena, void* ptr, kma_size_t size);
+kma_page_t* new_data_page(budarena* arena);
+freeblock* getFreeBlockIntrusive(budarena* arena, kma_size_t size);
+void push_block(budarena* arena, int index, freeblock* block);
+void unlink_block(budarena* arena, int index, freeblock* block);
+#ifdef BUD_ARENAS
+void drain_remote(budarena* arena);
+void unlock_arena(budarena* arena);
+int remote_pending(budarena* arena);
+void send_remote(int owner);
+void send_all_remote(void* arg);
+#endif
+#endif
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
+#ifndef BUD_INTRUSIVE
 void* kma_malloc(kma_size_t size)
 {
    // requestNumber++;
     //printf("\n\n REQUEST NUMBER %d TO ALLOCATE BLOCK OF SIZE %d\n",requestNumber,size);
 
+    if (size>PAGE_SIZE)
+    {
+        //large objects get a run of whole pages of their own
+        return get_pages((size + PAGE_SIZE - 1) / PAGE_SIZE)->ptr;
+    }
+
     size = adjustSize(size);
     //printf("Adjusted size to: %d\n",size);
-    if (size>PAGE_SIZE)
+
+    if (size==PAGE_SIZE)
     {
-        return NULL;
+        //a whole page never goes through the lists or the page nodes,
+        //kma_free finds it again with page_lookup
+        return get_page()->ptr;
     }
     
     if (!globalPtr)
@@ -170,23 +292,6 @@ void* kma_malloc(kma_size_t size)
     
     //did not find a free block
     //allocates new page and puts it in the list of blocks 
-    if (size==PAGE_SIZE)
-    {
-        //allocate new page
-        //add that as a 'free block' to blocks of size PAGESIZE
-        //and return that
-//	free_pages();
-       //printf("allocating an entire page \n");
-	kma_page_t* newPage = get_page();
-        //add_to_list(newFirstPage->ptr,PAGE_SIZE,newFirstPage);
-	//printf("adding to page node list: pagePtr= %p and page at %p \n",newPage,newPage->ptr);
-	addPageNode((void*)newPage->ptr,(void*)newPage);
-	//printf("RETURN ADDRESS IS %p \n",newPage->ptr);
-       // free_pages();
-	update_bitmap(newPage->ptr,PAGE_SIZE);
-	return newPage->ptr;
-    }
-
     allocate_new_page(); 
     
     //try again, this time it should be good
@@ -214,19 +319,17 @@ void kma_free(void* ptr, kma_size_t size)
     //requestNumber++;
     //printf("\n\n REQUEST NUMBER %d TO FREE BLOCK %p  OF SIZE %d\n",requestNumber,ptr,size);
 
+  if (size>PAGE_SIZE)
+  {
+      free_page(page_lookup(ptr));
+      return;
+  }
+
   size = adjustSize(size);
     
   if (size==PAGE_SIZE){
-
-    
-        //remove it as if it was a free node
-        void* pagePtr = (void*)(findPagePtr(ptr));
-	update_bitmap(ptr,size);
-	remove_from_pagelist(pagePtr);
-	//printf("230 \n");
-        free_page(pagePtr);
-       // update_bitmap(ptr,size);
-        free_pages();
+        //a whole page has no page node, it goes straight back
+        free_page(page_lookup(ptr));
         return;
   }
 
@@ -235,11 +338,12 @@ void kma_free(void* ptr, kma_size_t size)
 	//printf("coalescing blocks if possible\n");
   coalesce_blocks(ptr,size,0);
     
-  free_pages();
+  free_books();
 
 }
+#endif // BUD_INTRUSIVE
 
-void free_pages()
+void free_books()
 {
 
     pageheader* page = (pageheader*)(globalPtr->ptr);
@@ -270,7 +374,9 @@ void free_pages()
 	    //printf("\n COUNT: %d  - ends at %p \n",count,previous);
         }
     }
-	if (flag==1)
+	//the page nodes of data pages still in use live in the bookkeeping
+	//pages, so they only go once the last data page is gone as well
+	if (flag==1 && page->pageListHead==NULL && page->next==NULL)
 	{
 		//printf("freeing everything \n");
 		//free_page(page->ptr);
@@ -293,7 +399,7 @@ void allocate_new_page()
     addPageNode((void*)newPage->ptr, (void*)newPage);
     
     void* leftChildAddr = newPage->ptr;
-    void* rightChildAddr = (void*) ((int)(newPage->ptr)+(PAGE_SIZE/2));
+    void* rightChildAddr = (void*) ((uintptr_t)(newPage->ptr)+(PAGE_SIZE/2));
 
     add_to_list(leftChildAddr,PAGE_SIZE/2,newPage);
     add_to_list(rightChildAddr,PAGE_SIZE/2,newPage);
@@ -316,23 +422,14 @@ void update_bitmap(void* ptr,kma_size_t size)
     //find which bits in the bitmap to change
     //XOR the bits in question with 1 to flip them
  //  printf("hi, trying to update bitmap at %p of size %d \n",ptr,size); 
-    pageheader* page = (pageheader*)(globalPtr->ptr);
-    
-    pagenode* currentPageNode = (pagenode*)(page->pageListHead);
-    void* searchingPage = (void*)((((int)(ptr))>>13)<<13); 
-    
-//	printf("searching for page %p \n",searchingPage);
-//	printf("as a start, %p vs %p \n",currentPageNode->ptr,searchingPage);	
-while (currentPageNode->ptr!=searchingPage)
-   // while (!((void*)(ptr) > (void*)(currentPageNode->ptr) && (void*)(ptr) < (void*)((int)(currentPageNode->ptr) + PAGE_SIZE)))
-    {
-//	printf("current page node points to page: %p \n",currentPageNode->ptr);
-        currentPageNode = currentPageNode->next;
-    }
+    //the page node of every data page is registered as the page owner,
+    //so there is no need to walk the page node list
+    pagenode* currentPageNode = (pagenode*)page_owner(ptr);
+    assert(currentPageNode != NULL);
     //now you have reached the page that contains the specified address
   //  printf("here\n");
     //offset within the page
-    int pageOffset = (int)(ptr) - (int)(currentPageNode->ptr);
+    int pageOffset = (uintptr_t)(ptr) - (uintptr_t)(currentPageNode->ptr);
     int startingBit = pageOffset / MIN_SIZE;
     
     //the starting char within the page's bitmap
@@ -406,6 +503,8 @@ globalPtr = newFirstPage;
     firstPageHead->pType = BITMAP;
     firstPageHead->counter=0;
     firstPageHead->firstBlock = NULL;
+    firstPageHead->pageListHead = NULL;
+    listMask = 0;
     int i=0;
     for (i=0;i<=8;i++)
     {
@@ -420,35 +519,18 @@ globalPtr = newFirstPage;
 
 blocknode* getFreeBlock(kma_size_t size)
 {
-    //walk through the blocks until you find one that fits
     pageheader* page = (pageheader*)(globalPtr->ptr);    
-	//printf("page at is %p and points to %p\n",globalPtr->ptr,page->next);
-    //move on to the list page
-    //page = page->next;
-   //printf("list page is %p \n",page);
-    //listhead pointers = page->ptrs;
-    
-    //step through size 
-    int index = getListIndex(size);
-    int origIndex = index;
-//	printf("trying to get free block of size %d \n",size);
-    while (index<=7)
-    {
-	void* pointer = page->ptrs[index];
-        if (pointer!=NULL)
-        {
-  //      	printf("Found free block! in page %p \n",pointer);
-	    break;
-        }
-    //    printf("couldn't find at level %d, looking above\n",index);
-	index++;
-    }
 
-    if (index==8)
+    //the lowest set bit of the mask at or above the wanted list is the
+    //smallest list that has a block in it
+    int origIndex = getListIndex(size);
+    unsigned int candidates = listMask & ~((1u << origIndex) - 1);
+    if (candidates==0)
     {
         //did not find a good page
         return NULL;
     }
+    int index = __builtin_ctz(candidates);
     
     if (index==origIndex)
     {
@@ -499,24 +581,31 @@ kma_size_t adjustSize(kma_size_t num)
 
 blocknode* split_free_to_size(kma_size_t size, blocknode* node)
 {
-    if (node->size==size)
+    //halve the block until it has the size, the upper halves go in the
+    //lists one size down and the lower half is split again
+    while (node->size!=size)
     {
-        return node;
-    }
-    else {
-//	printf("splitting node from size %d to size %d\n",node->size,size);
-        //node is too big
-        //make children and recurse on left child
         void* leftChild = (void*)(node->ptr);
-        void* rightChild = (void*)((int)(leftChild) + ((int)node->size)/2);
-        kma_page_t* childrenPage = (kma_page_t*)(node->pagePtr);
         kma_size_t childrenSize = node->size/2;
+        void* rightChild = (void*)((uintptr_t)(leftChild) + childrenSize);
+        kma_page_t* childrenPage = (kma_page_t*)(node->pagePtr);
         remove_from_list(node);
-        
-        blocknode* lChild = add_to_list(rightChild,childrenSize,childrenPage);
 
-        lChild = add_to_list(leftChild,childrenSize,childrenPage);
-        return split_free_to_size(size,lChild);
+        add_to_list(rightChild,childrenSize,childrenPage);
+        node = add_to_list(leftChild,childrenSize,childrenPage);
+    }
+    return node;
+}
+
+void free_list_tail(blocknode* tail)
+{
+    //the list is compacted towards its head, so the node that falls off is
+    //always its last one. when that was the first node of an overflow page,
+    //the page is empty
+    pageheader* tailPage = (pageheader*)BASEADDR(tail);
+    if ((void*)tail == (void*)((uintptr_t)tailPage + sizeof(pageheader)))
+    {
+        free_page(tailPage->ptr);
     }
 }
 
@@ -551,9 +640,10 @@ void remove_from_list(blocknode* node)
     {
         //only one node
         page->ptrs[listIndex] = NULL;
+        listMask &= ~(1u << listIndex);
         //free the page where that node existed
         
-    	pageheader* pageTop = (void*)(((int)node>>13)<<13);
+    	pageheader* pageTop = BASEADDR(node);
     	//printf("*** freeing page for lists of size %d\n",listIndex);        
     	free_page(pageTop->ptr);
         return;
@@ -590,6 +680,7 @@ void remove_from_list(blocknode* node)
 	    if (current->next == NULL)
 	    {
 	    	previous->next = NULL;
+	    	free_list_tail(current);
 	    }
 	    else
 	    {
@@ -607,6 +698,7 @@ void remove_from_list(blocknode* node)
     }
    //last case, it's the last one but not the first one
     previous->next = NULL;
+    free_list_tail(current);
 
 	return;
 }
@@ -670,10 +762,11 @@ blocknode* add_to_list(void* ptr,kma_size_t size, kma_page_t* pagePtr)
         newListPageHead->next = NULL;
         newListPageHead->counter=0;
         newListPageHead->pType = LISTS;
-        newListPageHead->firstBlock = (void*)((int)newListPageHead + sizeof(pageheader));; 
+        newListPageHead->firstBlock = (void*)((uintptr_t)newListPageHead + sizeof(pageheader)); 
 
         //link the array to this page
         page->ptrs[listIndex] = (void*)newListPageHead;
+        listMask |= 1u << listIndex;
 //	printf("pointer of list %d points to new pageList %p \n",listIndex,page->ptrs[listIndex]);
         //and put the first node in the list
         blocknode* firstBlock = newListPageHead->firstBlock;
@@ -696,9 +789,21 @@ blocknode* add_to_list(void* ptr,kma_size_t size, kma_page_t* pagePtr)
         previous = current;
         current = current->next;
     }
-    //now add it at the end of that list
-    previous->next = (void*)((int)(previous)+sizeof(blocknode));
-    blocknode* newNode = previous->next;
+    //now add it at the end of that list. a list that outgrows its page
+    //goes on at the start of a page of its own
+    blocknode* newNode = (blocknode*)((uintptr_t)(previous)+sizeof(blocknode));
+    if ((uintptr_t)(newNode + 1) > (uintptr_t)BASEADDR(previous) + PAGE_SIZE)
+    {
+        kma_page_t* newListPage = get_page();
+        *((kma_page_t**)newListPage->ptr) = newListPage;
+        pageheader* newListPageHead = (pageheader*)newListPage->ptr;
+        newListPageHead->next = NULL;
+        newListPageHead->counter=0;
+        newListPageHead->pType = LISTS;
+        newListPageHead->firstBlock = (void*)((uintptr_t)newListPageHead + sizeof(pageheader));
+        newNode = newListPageHead->firstBlock;
+    }
+    previous->next = newNode;
     newNode->ptr = ptr;
     newNode->size = size;
     newNode->next = NULL;
@@ -713,7 +818,7 @@ void coalesce_blocks(void* ptr,kma_size_t size,int fromRecursion)
 	//printf("trying to coalesce a block at ptr %p and of size: %d \n",ptr,size);
 
 	//find buddy
-	void* buddyAddr = (void*)((int)ptr ^ (int)size);
+	void* buddyAddr = (void*)((uintptr_t)ptr ^ (uintptr_t)size);
 //    printf("buddy address is %p \n",buddyAddr);
 	int fBuddy;
 	fBuddy =  findBuddy(buddyAddr,size);
@@ -775,13 +880,14 @@ void coalesce_blocks(void* ptr,kma_size_t size,int fromRecursion)
             	}
                 	//add to list
     	//   	 printf("adding to list node of size %d*2 at %p \n",buddy->size,lowerAddress);
-            	blocknode* parentNode = add_to_list(lowerAddress, buddy->size*2, buddy->pagePtr);
+            	kma_size_t parentSize = buddy->size*2;
+            	add_to_list(lowerAddress, parentSize, buddy->pagePtr);
             	//and remove previous ones from list
-   	       	//remove only the buddy
-            	//remove_from_list(node);
+   	       	//remove only the buddy. removing compacts the list, so the
+   	       	//parent's node may move and is not used after this
             	remove_from_list(buddy);
 
-            	return coalesce_blocks(parentNode->ptr,parentNode->size,1);
+            	return coalesce_blocks(lowerAddress,parentSize,1);
         	}
     	}   
     	else {
@@ -798,7 +904,8 @@ void coalesce_blocks(void* ptr,kma_size_t size,int fromRecursion)
    	   	remove_from_pagelist(buddy->pagePtr);
    	   	//printf("820 \n");
 		remove_from_list(node);
-   	   	remove_from_list(buddy);
+   	   	//the buddy's node may have moved up into node's place
+   	   	remove_from_list(findBlock(buddyAddr,size));
    	   	return;
         	}
         	else {
@@ -807,10 +914,12 @@ void coalesce_blocks(void* ptr,kma_size_t size,int fromRecursion)
                 	lowerAddress = buddy->ptr;
             	}
            		 //printf("Adding to list node of size %d*2 at %p \n",buddy->size,lowerAddress);
-   			 blocknode* parentNode = add_to_list(lowerAddress,buddy->size*2,buddy->pagePtr);
+   			 kma_size_t parentSize = buddy->size*2;
+   			 add_to_list(lowerAddress,parentSize,buddy->pagePtr);
    			 remove_from_list(node);
-   			 remove_from_list(buddy);
-   			 return coalesce_blocks(parentNode->ptr,parentNode->size,1);
+   			 //the buddy's node may have moved up into node's place
+   			 remove_from_list(findBlock(buddyAddr,size));
+   			 return coalesce_blocks(lowerAddress,parentSize,1);
        	}
     	}
 	}
@@ -838,61 +947,45 @@ blocknode* findBlock(void* ptr, kma_size_t size)
 
 int findBuddy(void* buddyAddr,kma_size_t size)
 {
-  // printf("looking for buddy \n");
-	int listIndex = getListIndex(size);
-	pageheader* page = (pageheader*)(globalPtr->ptr);    
+	//answer straight from the bitmap of the page the buddy lives in.
+	//a set bit means that 32 byte chunk is handed out, and since blocks
+	//are coalesced as soon as both halves are free, a buddy with all of
+	//its bits clear can only be sitting whole in the free list
+	pagenode* buddyPageNode = (pagenode*)page_owner(buddyAddr);
+	if (buddyPageNode==NULL)
+	{
+		return 0;
+	}
+	int startingBit = ((char*)buddyAddr - (char*)(buddyPageNode->ptr)) / MIN_SIZE;
+	int startingChar = startingBit / 8;
+	int charOffset = startingBit % 8;
+	int sizeInBits = size / MIN_SIZE;
+	unsigned char* bitmap = (unsigned char*)(buddyPageNode->bitmap);
+
+	//buddy fits inside one char, same msb-first layout as update_bitmap
+	if (sizeInBits < 8)
+	{
+		unsigned char mask = ((1 << sizeInBits) - 1) << (8 - charOffset - sizeInBits);
+		return (bitmap[startingChar] & mask) == 0;
+	}
 
-	//no longer have a list page
-	//page = page->next;
-    pageheader* blockPage = (pageheader*)(page->ptrs[listIndex]);
-    if (blockPage==NULL){
-   	 //there are no free blocks here
-   	 return 0;
-    }
-    blocknode* firstNode = (blocknode*)(blockPage->firstBlock);   
-// blocknode* firstNode = (blocknode*)(page->ptrs[listIndex]);
-	blocknode* current = firstNode;
-//    printf("nodes begin at %p \n",current);
-	while (current!=NULL)
+	//buddy covers whole chars, which are always char aligned
+	int j;
+	for (j = startingChar; j < startingChar + sizeInBits / 8; j++)
 	{
-    	if (current->ptr == buddyAddr)
-    	{
-//   	 printf("found it! %p->%p \n",current,current->ptr);
-        	return 1;
-    	}
-    	current = current->next;
+		if (bitmap[j] != 0)
+		{
+			return 0;
+		}
 	}
-	//couldn't find it, return 0
-//    printf("couldn't find it. return 0 \n");
-	return 0;
+	return 1;
 }
 
 void* findPagePtr(void* ptr)
 {
-	//go through the list of pages until we find one that corresponds
-	//return its pagePtr (the one used to free the page)
-    
-	void* pageToFind = (void*)(((int)ptr>>13)<<13);
-	//printf("Page to find: %p \n",pageToFind);
-	pageheader* page = (pageheader*)(globalPtr->ptr);
-    
-	//no longer have a list page
-	//page = page->next;
-    
-	pagenode* currentPage = (pagenode*)(page->pageListHead);
-	//printf("firstPage: %p ",currentPage);
-	while (currentPage!=NULL)
-	{
-    //printf("currentPage: %p and looking for %p \n",currentPage->ptr,pageToFind);
-    	if (currentPage->ptr==pageToFind)
-    	{
-   	 //printf("found page, points to %p \n",currentPage->pagePtr);
-        	return currentPage->pagePtr;
-    	}
-    currentPage = currentPage->next;
-	}
-	return NULL;
-    
+	//return the pagePtr (the one used to free the page) straight from
+	//the page layer's reverse map
+	return page_lookup(ptr);
 }
 void addPageNode(void* ptr,void* pagePtr)
 {
@@ -910,7 +1003,7 @@ void addPageNode(void* ptr,void* pagePtr)
 	}
 	//printf("Page where we add the node is %p \n",page);	
 	//if the last page for page nodes is full, need to create a new page to add more
-	if (page->counter >= 180)
+	if (page->counter >= PAGENODES_PER_PAGE)
 	{
 		//printf("creating new page of pagenodes \n");
 	    pagenode* beforeNew = firstPageNode;
@@ -938,7 +1031,7 @@ void addPageNode(void* ptr,void* pagePtr)
 		//printf("I made it to line 963 \n");
         	pagenode* newPageNode;
 		//printf("new page is at location %p and kma_ptr is %p \n",newPage,newPage->ptr);
-        	newPageNode = (pagenode*)((int)(newPageHead) + sizeof(pageheader));
+        	newPageNode = (pagenode*)((uintptr_t)(newPageHead) + sizeof(pageheader));
         	//printf("and the new page node is at %p \n",newPageNode);
         	newPageNode->ptr = ptr;
     		newPageNode->pagePtr = pagePtr;
@@ -950,6 +1043,7 @@ void addPageNode(void* ptr,void* pagePtr)
     		
     		beforeNew->next = newPageNode;
     		page->next = newPageHead;
+    		page_set_owner((kma_page_t*)pagePtr, newPageNode);
     	
     		return;    
 	}
@@ -964,7 +1058,7 @@ void addPageNode(void* ptr,void* pagePtr)
 
 	if (currentPageNode==NULL)
 	{
-    	currentPageNode = (pagenode*)((int)(page) + sizeof(pageheader));
+    	currentPageNode = (pagenode*)((uintptr_t)(page) + sizeof(pageheader));
 	    //printf("empty list starts at %p \n",currentPageNode);
     	currentPageNode->ptr = ptr;
     	currentPageNode->pagePtr = pagePtr;
@@ -975,6 +1069,7 @@ void addPageNode(void* ptr,void* pagePtr)
         currentPageNode->next = NULL;
         //printf("added page node at %p and pagePtr points to %p \n",currentPageNode,currentPageNode->pagePtr);
    	    page->pageListHead =(void*)currentPageNode;
+   	    page_set_owner((kma_page_t*)pagePtr, currentPageNode);
    	    
    	    //add to the list
    	    page->counter=1;
@@ -992,10 +1087,10 @@ void addPageNode(void* ptr,void* pagePtr)
     	while (currentPageNode!=NULL && flag==0)
     	{
 		count++;
-		//if (count>500) {	printf("%d pages and node at %p . last page is %p - count: %d vs  %d \n", count,currentPageNode,page,(count%180),page->counter); }
-        	cPage = (void*)((((int)currentPageNode)>>13)<<13);
+		//if (count>500) {	printf("%d pages and node at %p . last page is %p - count: %d vs  %d \n", count,currentPageNode,page,(count%PAGENODES_PER_PAGE),page->counter); }
+        	cPage = BASEADDR(currentPageNode);
 	//	if (count>500) { printf("cpage: %p and page: %p\n ",cPage,page); }
-		if (cPage==page && ((count)%180==page->counter)) { flag=1; }
+		if (cPage==page && ((count)%PAGENODES_PER_PAGE==page->counter)) { flag=1; }
 		previousPageNode = currentPageNode;
         	currentPageNode = currentPageNode->next;
 		
@@ -1005,7 +1100,7 @@ void addPageNode(void* ptr,void* pagePtr)
 	    //printf("Do we get here?\n");
 
     	//at the tail nde
-    	previousPageNode->next = (pagenode*)((int)(previousPageNode) + sizeof(pagenode));
+    	previousPageNode->next = (pagenode*)((uintptr_t)(previousPageNode) + sizeof(pagenode));
     	newPageNode = previousPageNode->next;
     	newPageNode->ptr = ptr;
     	newPageNode->pagePtr = pagePtr;
@@ -1014,6 +1109,7 @@ void addPageNode(void* ptr,void* pagePtr)
     	{
         	newPageNode->bitmap[i] = 0;
     	}
+    	page_set_owner((kma_page_t*)pagePtr, newPageNode);
     	//printf("The last pagenode is at %p and the new one at %p \n",previousPageNode,newPageNode);
 	//printf("New page node points to data page %p \n",newPageNode->ptr);
     	//add to the page counter
@@ -1084,6 +1180,8 @@ void remove_from_pagelist(void* pagePtr)
         	{
             	previousPageNode->bitmap[j] = currentPageNode->bitmap[j];
         	}
+        	//the node moved, so point its page at the new location
+        	page_set_owner(previousPageNode->pagePtr, previousPageNode);
 
     		if (currentPageNode->next == NULL)
     		{
@@ -1106,7 +1204,7 @@ else {
 	previousPageNode->next = NULL;
 }
 //now decrease the counter 
-    	pageheader* currentPage = (pageheader*)(((int)(previousPageNode)>>13)<<13);
+    	pageheader* currentPage = (pageheader*)BASEADDR(previousPageNode);
 	//printf("Page to decrease counter: %p from %d \n",currentPage,currentPage->counter);
     	currentPage->counter--;
     	
@@ -1148,5 +1246,317 @@ else {
     
 }
 
+#ifdef BUD_INTRUSIVE
+void* kma_malloc(kma_size_t size)
+{
+    if (size>PAGE_SIZE)
+    {
+        //large objects get a run of whole pages of their own
+        return get_pages((size + PAGE_SIZE - 1) / PAGE_SIZE)->ptr;
+    }
+
+    size = adjustSize(size);
+    pthread_once(&budOnce,init_arenas);
+    budarena* arena = thread_arena();
+#ifdef BUD_ARENAS
+    //hand over what this thread freed for others, then take what others
+    //freed for this arena
+    if (pendingCount > 0)
+    {
+        send_all_remote(NULL);
+    }
+#endif
+    ARENA_LOCK(arena);
+#ifdef BUD_ARENAS
+    drain_remote(arena);
+#endif
+
+    //a whole page is handed out directly and never goes through the lists
+    if (size==PAGE_SIZE)
+    {
+        kma_page_t* newPage = new_data_page(arena);
+        update_bitmap(newPage->ptr,PAGE_SIZE);
+        ARENA_UNLOCK(arena);
+        return newPage->ptr;
+    }
+
+    freeblock* block = getFreeBlockIntrusive(arena,size);
+    if (block==NULL)
+    {
+        //no block big enough, put the two halves of a new page in the lists
+        kma_page_t* newPage = new_data_page(arena);
+        push_block(arena,NUM_LISTS-1,(freeblock*)(newPage->ptr + PAGE_SIZE/2));
+        push_block(arena,NUM_LISTS-1,(freeblock*)(newPage->ptr));
+        block = getFreeBlockIntrusive(arena,size);
+    }
+
+    update_bitmap(block,size);
+    ARENA_UNLOCK(arena);
+    return (void*)block;
+}
+
+void kma_free(void* ptr, kma_size_t size)
+{
+    if (size>PAGE_SIZE)
+    {
+        free_page(page_lookup(ptr));
+        return;
+    }
+
+    size = adjustSize(size);
+#ifdef BUD_ARENAS
+    //a block of a page of another arena joins this thread's batch for
+    //that arena. its bitmap and lists are only touched under the arena's
+    //lock. a thread that never allocates is not bound to an arena and
+    //frees straight into the owner
+    int owner = page_lookup(ptr)->heap;
+    budarena* arena = &arenas[owner];
+    if (myArena >= 0 && owner != myArena)
+    {
+        remotebatch* batch = &pendingFrees[owner];
+        remoteblock* block = (remoteblock*)ptr;
+        block->size = size;
+        block->link.next = (kma_lfnode_t*)batch->first;
+        batch->first = block;
+        if (batch->count++ == 0)
+        {
+            batch->last = block;
+            if (pendingCount++ == 0)
+            {
+                //any value but NULL runs send_all_remote() at thread exit
+                pthread_setspecific(pendingKey,pendingFrees);
+            }
+        }
+        if (batch->count == REMOTE_BATCH)
+        {
+            send_remote(owner);
+        }
+        return;
+    }
+#else
+    budarena* arena = thread_arena();
+#endif
+
+    ARENA_LOCK(arena);
+#ifdef BUD_ARENAS
+    drain_remote(arena);
+#endif
+    free_block(arena,ptr,size);
+    ARENA_UNLOCK(arena);
+#ifdef BUD_ARENAS
+    //the thread's own arena is settled, so are its partial batches. a
+    //thread that only frees from now on does not sit on them
+    if (pendingCount > 0)
+    {
+        send_all_remote(NULL);
+    }
+#endif
+}
+
+void init_arenas()
+{
+    pageNodes = malloc(page_max() * sizeof(pagenode));
+    assert(pageNodes != NULL);
+#ifdef BUD_ARENAS
+    int i;
+    for (i=0;i<BUD_ARENAS;i++)
+    {
+        pthread_mutex_init(&arenas[i].lock,NULL);
+    }
+    pthread_key_create(&pendingKey,send_all_remote);
+#endif
+}
+
+budarena* thread_arena()
+{
+#ifdef BUD_ARENAS
+    if (myArena < 0)
+    {
+        myArena = __atomic_fetch_add(&nextArena,1,__ATOMIC_RELAXED) % BUD_ARENAS;
+    }
+    return &arenas[myArena];
+#else
+    return &theArena;
+#endif
+}
+
+void free_block(budarena* arena, void* ptr, kma_size_t size)
+{
+    update_bitmap(ptr,size);
+
+    //merge with the buddy for as long as the buddy is free. the buddy is
+    //at the same offset in the page with the size bit flipped
+    void* page = BASEADDR(ptr);
+    while (size<PAGE_SIZE)
+    {
+        void* buddyAddr = page + (((char*)ptr - (char*)page) ^ size);
+        if (!findBuddy(buddyAddr,size))
+        {
+            break;
+        }
+        unlink_block(arena,getListIndex(size),(freeblock*)buddyAddr);
+        if (buddyAddr<ptr)
+        {
+            ptr = buddyAddr;
+        }
+        size = size*2;
+    }
+
+    if (size==PAGE_SIZE)
+    {
+        //the whole page is free again
+        free_page(page_lookup(page));
+        return;
+    }
+
+    push_block(arena,getListIndex(size),(freeblock*)ptr);
+}
+
+#ifdef BUD_ARENAS
+void drain_remote(budarena* arena)
+{
+    //take the whole queue at once and free it like local frees
+    remoteblock* block = (remoteblock*)lfstack_pop_all(&arena->remoteFrees);
+    while (block!=NULL)
+    {
+        remoteblock* next = (remoteblock*)block->link.next;
+        free_block(arena,block,block->size);
+        block = next;
+    }
+}
+
+int remote_pending(budarena* arena)
+{
+    //a read-modify-write that leaves the queue as it is. it orders an
+    //unlock before it against a push and a trylock after a later one
+    return LFSTACK_PTR(__atomic_fetch_or(&arena->remoteFrees.top,0,__ATOMIC_ACQ_REL)) != NULL;
+}
+
+void unlock_arena(budarena* arena)
+{
+    //whoever lets go of an arena frees what was queued for it in the
+    //meantime. with send_remote() trying the lock after every push, a
+    //queue is never left behind by an owner that went idle or exited
+    pthread_mutex_unlock(&arena->lock);
+    while (remote_pending(arena) && pthread_mutex_trylock(&arena->lock) == 0)
+    {
+        drain_remote(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+void send_remote(int owner)
+{
+    //one push for the whole batch, so the owner's queue sees one
+    //exchange per REMOTE_BATCH frees
+    remotebatch* batch = &pendingFrees[owner];
+    budarena* arena = &arenas[owner];
+    lfstack_push_chain(&arena->remoteFrees,&batch->first->link,&batch->last->link);
+    batch->first = NULL;
+    batch->last = NULL;
+    batch->count = 0;
+    pendingCount--;
+
+    //an arena nobody holds frees the batch right away, one that is held
+    //gets it when its holder unlocks
+    if (remote_pending(arena) && pthread_mutex_trylock(&arena->lock) == 0)
+    {
+        drain_remote(arena);
+        unlock_arena(arena);
+    }
+}
+
+void send_all_remote(void* arg)
+{
+    int i;
+    for (i=0;i<BUD_ARENAS && pendingCount>0;i++)
+    {
+        if (pendingFrees[i].count>0)
+        {
+            send_remote(i);
+        }
+    }
+}
+#endif
+
+kma_page_t* new_data_page(budarena* arena)
+{
+    //get a page and hook up its page node with an empty bitmap
+    kma_page_t* newPage = get_page();
+    pagenode* node = &pageNodes[page_index(newPage->ptr)];
+    int i;
+
+    node->ptr = newPage->ptr;
+    node->pagePtr = newPage;
+    node->next = NULL;
+    for (i=0;i<32;i++)
+    {
+        node->bitmap[i] = 0;
+    }
+#ifdef BUD_ARENAS
+    newPage->heap = arena - arenas;
+#endif
+    page_set_owner(newPage,node);
+    return newPage;
+}
+
+freeblock* getFreeBlockIntrusive(budarena* arena, kma_size_t size)
+{
+    //the lowest set bit of the mask at or above the wanted list is the
+    //smallest list that has a block in it
+    int origIndex = getListIndex(size);
+    unsigned int candidates = arena->freeMask & ~((1u << origIndex) - 1);
+    if (candidates==0)
+    {
+        return NULL;
+    }
+
+    int index = __builtin_ctz(candidates);
+    freeblock* block = arena->freeLists[index];
+    unlink_block(arena,index,block);
+
+    //split down to size, keeping the lower half and putting the upper
+    //half in the list one size down
+    while (index>origIndex)
+    {
+        index--;
+        push_block(arena,index,(freeblock*)((char*)block + (MIN_SIZE << index)));
+    }
+    return block;
+}
+
+void push_block(budarena* arena, int index, freeblock* block)
+{
+    block->prev = NULL;
+    block->next = arena->freeLists[index];
+    if (arena->freeLists[index] != NULL)
+    {
+        arena->freeLists[index]->prev = block;
+    }
+    arena->freeLists[index] = block;
+    arena->freeMask |= 1u << index;
+}
+
+void unlink_block(budarena* arena, int index, freeblock* block)
+{
+    if (block->prev != NULL)
+    {
+        ((freeblock*)block->prev)->next = block->next;
+    }
+    else
+    {
+        arena->freeLists[index] = block->next;
+        if (arena->freeLists[index] == NULL)
+        {
+            arena->freeMask &= ~(1u << index);
+        }
+    }
+
+    if (block->next != NULL)
+    {
+        ((freeblock*)block->next)->prev = block->prev;
+    }
+}
+#endif // BUD_INTRUSIVE
 
 #endif // KMA_BUD
@@ -71,18 +71,12 @@ void* kma_malloc(kma_size_t size)
 {
   kma_page_t* page;
   
-  // get one page
-  page = get_page();
+  // get as many pages as the request needs
+  page = get_pages((size + sizeof(kma_page_t*) + PAGESIZE - 1) / PAGESIZE);
   
   // add a pointer to the page structure at the beginning of the page
   *((kma_page_t**)page->ptr) = page;
   
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
-    }
-  
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
   //{
@@ -0,0 +1,164 @@
+/***************************************************************************
+ *  Title: Lock-Free Free List
+ * -------------------------------------------------------------------------
+ *    Purpose: Treiber stack of free blocks for concurrent allocators,
+ *             with a tag next to the top pointer against ABA
+ *    Author: bpv512, jjk612
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: bpv512,jjk612
+
+ ***************************************************************************/
+
+#ifndef __KMA_LFSTACK_H__
+#define __KMA_LFSTACK_H__
+
+/************System include***********************************************/
+#include <stdint.h>
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* user space pointers fit in the low 48 bits of a word on x86-64 and
+ * arm64, the 16 bits above them count changes of the top. a pop fails
+ * whenever the top changed since it was read, unless exactly a multiple
+ * of 65536 pushes and pops happened in between */
+#define LFSTACK_PTR_BITS 48
+#define LFSTACK_PTR_MASK ((((uint64_t) 1) << LFSTACK_PTR_BITS) - 1)
+
+#define LFSTACK_PTR(top) ((kma_lfnode_t*)(uintptr_t)((top) & LFSTACK_PTR_MASK))
+#define LFSTACK_TAG(top) ((top) >> LFSTACK_PTR_BITS)
+#define LFSTACK_PACK(ptr, tag) \
+  ((((uint64_t) (tag)) << LFSTACK_PTR_BITS) | (uint64_t)(uintptr_t)(ptr))
+
+/* link at the start of a free block */
+typedef struct kma_lfnode
+{
+  struct kma_lfnode* next;
+} kma_lfnode_t;
+
+/* the tagged top of the stack, a zero word is an empty stack */
+typedef struct
+{
+  uint64_t top;
+} kma_lfstack_t;
+
+#define LFSTACK_INIT { 0 }
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Push a free block
+ * ---------------------------------------------------------------------
+ *    Purpose: Push a block on the stack without a lock
+ *    Input: the stack, the block
+ *    Output: none
+ ***********************************************************************/
+static inline void
+lfstack_push(kma_lfstack_t* stack, kma_lfnode_t* node)
+{
+  uint64_t top = __atomic_load_n(&stack->top, __ATOMIC_RELAXED);
+  uint64_t next;
+
+  do
+    {
+      __atomic_store_n(&node->next, LFSTACK_PTR(top), __ATOMIC_RELAXED);
+      next = LFSTACK_PACK(node, LFSTACK_TAG(top) + 1);
+    }
+  while (!__atomic_compare_exchange_n(&stack->top, &top, next, 1,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/***********************************************************************
+ *  Title: Push a chain of free blocks
+ * ---------------------------------------------------------------------
+ *    Purpose: Push blocks that are already linked through their next
+ *             pointers with a single exchange
+ *    Input: the stack, the first and the last block of the chain
+ *    Output: none
+ ***********************************************************************/
+static inline void
+lfstack_push_chain(kma_lfstack_t* stack, kma_lfnode_t* first, kma_lfnode_t* last)
+{
+  uint64_t top = __atomic_load_n(&stack->top, __ATOMIC_RELAXED);
+  uint64_t next;
+
+  do
+    {
+      __atomic_store_n(&last->next, LFSTACK_PTR(top), __ATOMIC_RELAXED);
+      next = LFSTACK_PACK(first, LFSTACK_TAG(top) + 1);
+    }
+  while (!__atomic_compare_exchange_n(&stack->top, &top, next, 1,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/***********************************************************************
+ *  Title: Pop a free block
+ * ---------------------------------------------------------------------
+ *    Purpose: Pop a block off the stack without a lock. A block that
+ *             was on the stack is read even after another thread took
+ *             it, so the blocks must stay mapped while the stack is in
+ *             use, as pool pages do
+ *    Input: the stack
+ *    Output: the block, or NULL if the stack is empty
+ ***********************************************************************/
+static inline kma_lfnode_t*
+lfstack_pop(kma_lfstack_t* stack)
+{
+  uint64_t top = __atomic_load_n(&stack->top, __ATOMIC_ACQUIRE);
+  uint64_t next;
+  kma_lfnode_t* node;
+
+  do
+    {
+      node = LFSTACK_PTR(top);
+      if (node == NULL)
+	{
+	  return NULL;
+	}
+      // a stale next is harmless, the tag makes the exchange fail
+      next = LFSTACK_PACK(__atomic_load_n(&node->next, __ATOMIC_RELAXED),
+			  LFSTACK_TAG(top) + 1);
+    }
+  while (!__atomic_compare_exchange_n(&stack->top, &top, next, 1,
+				      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+  return node;
+}
+
+/***********************************************************************
+ *  Title: Take every free block
+ * ---------------------------------------------------------------------
+ *    Purpose: Empty the stack in one exchange, the blocks stay linked
+ *             through their next pointers
+ *    Input: the stack
+ *    Output: the former top block, or NULL if the stack was empty
+ ***********************************************************************/
+static inline kma_lfnode_t*
+lfstack_pop_all(kma_lfstack_t* stack)
+{
+  uint64_t top = __atomic_load_n(&stack->top, __ATOMIC_RELAXED);
+
+  // the tag keeps counting so a pop that read the old top still fails
+  while (!__atomic_compare_exchange_n(&stack->top, &top,
+				      LFSTACK_PACK(NULL, LFSTACK_TAG(top) + 1), 1,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    ;
+
+  return LFSTACK_PTR(top);
+}
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_LFSTACK_H__ */
@@ -0,0 +1,179 @@
+/***************************************************************************
+ *  Title: Lock-Free Free List Stress Test
+ * -------------------------------------------------------------------------
+ *    Purpose: Many threads popping and pushing the same blocks, checking
+ *             that no block is ever handed out twice or lost
+ *    Author: bpv512, jjk612
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: bpv512,jjk612
+
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kma_lfstack.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define MAX_THREADS 256
+#define MAX_NODES 4096
+
+// blocks popped at a time before they are pushed back
+#define BATCH 4
+
+typedef struct
+{
+  kma_lfnode_t link;
+  int held;
+} node_t;
+
+/************Global Variables*********************************************/
+
+static kma_lfstack_t stack = LFSTACK_INIT;
+static node_t nodes[MAX_NODES];
+static int numNodes;
+static int iterations;
+static int failures = 0;
+
+/************Function Prototypes******************************************/
+void* stress(void*);
+int run(int, int);
+int drain();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int threads = argc > 1 ? atoi(argv[1]) : 16;
+  int ok = 1;
+
+  iterations = argc > 2 ? atoi(argv[2]) : 200000;
+  if (threads < 1 || threads > MAX_THREADS || iterations < 1)
+    {
+      printf("Usage: %s [threads (1-%d)] [iterations]\n", argv[0], MAX_THREADS);
+      return 1;
+    }
+
+  // a few blocks make the same block come back to the top all the time,
+  // which is when ABA would hit. many blocks test the links
+  ok &= run(threads, threads < 4 ? 2 : threads / 2);
+  ok &= run(threads, MAX_NODES);
+
+  printf("Test: %s\n", ok ? "PASS" : "FAILED");
+  return ok ? 0 : 1;
+}
+
+int
+run(int threads, int count)
+{
+  pthread_t tid[MAX_THREADS];
+  long i;
+  int left;
+
+  numNodes = count;
+  memset(nodes, 0, sizeof(nodes));
+  for (i = 0; i < numNodes; i++)
+    {
+      lfstack_push(&stack, &nodes[i].link);
+    }
+
+  failures = 0;
+  for (i = 0; i < threads; i++)
+    {
+      pthread_create(&tid[i], NULL, stress, (void*) i);
+    }
+  for (i = 0; i < threads; i++)
+    {
+      pthread_join(tid[i], NULL);
+    }
+
+  left = drain();
+  printf("%d threads, %d blocks: %d double pops, %d of %d blocks back\n",
+	 threads, numNodes, failures, left, numNodes);
+  return failures == 0 && left == numNodes;
+}
+
+void*
+stress(void* arg)
+{
+  unsigned int seed = (unsigned int)(long) arg;
+  node_t* held[BATCH];
+  int i, j, n;
+
+  for (i = 0; i < iterations; i++)
+    {
+      // now and then take the whole stack and give it back one by one
+      if (rand_r(&seed) % 1024 == 0)
+	{
+	  kma_lfnode_t* node = lfstack_pop_all(&stack);
+	  while (node != NULL)
+	    {
+	      kma_lfnode_t* next = node->next;
+	      lfstack_push(&stack, node);
+	      node = next;
+	    }
+	  continue;
+	}
+
+      n = 1 + rand_r(&seed) % BATCH;
+      for (j = 0; j < n; j++)
+	{
+	  held[j] = (node_t*) lfstack_pop(&stack);
+	  if (held[j] == NULL)
+	    {
+	      break;
+	    }
+	  if (__atomic_exchange_n(&held[j]->held, 1, __ATOMIC_ACQ_REL) != 0)
+	    {
+	      __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+	    }
+	}
+
+      while (j-- > 0)
+	{
+	  __atomic_store_n(&held[j]->held, 0, __ATOMIC_RELEASE);
+	  lfstack_push(&stack, &held[j]->link);
+	}
+    }
+
+  return NULL;
+}
+
+int
+drain()
+{
+  static char seen[MAX_NODES];
+  kma_lfnode_t* node;
+  int count = 0;
+
+  // every block must come back exactly once
+  memset(seen, 0, sizeof(seen));
+  while ((node = lfstack_pop(&stack)) != NULL)
+    {
+      int i = (node_t*) node - nodes;
+
+      if (i < 0 || i >= numNodes || seen[i]++)
+	{
+	  failures++;
+	  continue;
+	}
+      count++;
+    }
+
+  return count;
+}
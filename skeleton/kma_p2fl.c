@@ -38,7 +38,7 @@
  ************************************************************************/
 
 /************************************************************************
- Project Group: NetID1, NetID2, NetID3
+ Project Group: bpv512,jjk612
  
  ***************************************************************************/
 
@@ -59,10 +59,53 @@
  *  variables should be in all lower case. When initializing
  *  structures and arrays, line everything up in neat columns.
  */
+#define MIN_POWER2 5
+#define MIN_SIZE 32
+#define PAGE_SIZE 8192
+
+//free lists for sizes 32, 64, 128, 256, 512, 1024, 2048
+//anything bigger gets a page of its own
+#define NUM_CLASSES 7
+#define MAX_CLASS_SIZE (MIN_SIZE << (NUM_CLASSES - 1))
+
+//a free block links itself into the free list of its size class
+typedef struct free_block
+{
+    void* next;
+    void* prev;
+} freeblock;
+
+//per page usage, kept out of the page in an array indexed by page
+//number so a page holds a whole number of blocks of its class
+typedef struct page_usage
+{
+    short sizeClass;
+    short used;
+} pageusage;
 
 /************Global Variables*********************************************/
 
+//one free list per size class
+freeblock* freeLists[NUM_CLASSES] = { NULL };
+
+//usage of every page of the pool, indexed by page number. sized from
+//the pool on first use
+pageusage* pageUsage = NULL;
+
+//one empty page per class stays carved, so a class going back and
+//forth across a page boundary does not get and free a page each time
+void* emptyPages[NUM_CLASSES] = { NULL };
+
+//blocks and large objects handed out and not freed yet
+int liveBlocks = 0;
+
 /************Function Prototypes******************************************/
+int getClassIndex(kma_size_t size);
+void carve_page(int index);
+void push_block(int index, freeblock* block);
+void unlink_block(int index, freeblock* block);
+void release_page(void* page);
+void release_empty_pages();
 
 /************External Declaration*****************************************/
 
@@ -70,12 +113,166 @@
 
 void* kma_malloc(kma_size_t size)
 {
-  return NULL;
+    liveBlocks++;
+
+    if (size > MAX_CLASS_SIZE)
+    {
+        //large request, give it whole pages of its own
+        return get_pages((size + PAGE_SIZE - 1) / PAGE_SIZE)->ptr;
+    }
+
+    int index = getClassIndex(size);
+
+    if (freeLists[index] == NULL)
+    {
+        carve_page(index);
+    }
+
+    //pop the head of the list
+    freeblock* block = freeLists[index];
+    unlink_block(index, block);
+
+    pageusage* page = &pageUsage[page_index(block)];
+    page->used++;
+    if (page->used == 1 && emptyPages[index] == BASEADDR(block))
+    {
+        //the cached page is in use again
+        emptyPages[index] = NULL;
+    }
+
+    return (void*)block;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
-  ;
+    liveBlocks--;
+
+    if (size > MAX_CLASS_SIZE)
+    {
+        //the block owns its pages
+        free_page(page_lookup(ptr));
+    }
+    else
+    {
+        pageusage* page = &pageUsage[page_index(ptr)];
+        assert(page->sizeClass == getClassIndex(size));
+
+        push_block(page->sizeClass, (freeblock*)ptr);
+
+        page->used--;
+        if (page->used == 0)
+        {
+            //keep the page if the class has no empty one yet
+            if (emptyPages[page->sizeClass] == NULL)
+            {
+                emptyPages[page->sizeClass] = BASEADDR(ptr);
+            }
+            else
+            {
+                release_page(BASEADDR(ptr));
+            }
+        }
+    }
+
+    if (liveBlocks == 0)
+    {
+        //nothing is allocated any more, so the cached pages go back too
+        release_empty_pages();
+    }
+}
+
+int getClassIndex(kma_size_t size)
+{
+    //smallest class whose blocks fit size
+    int index = 0;
+    while ((MIN_SIZE << index) < size)
+    {
+        index++;
+    }
+    return index;
+}
+
+void carve_page(int index)
+{
+    //get a new page and split all of it into blocks of one size class
+    kma_page_t* newPage = get_page();
+    kma_size_t blockSize = MIN_SIZE << index;
+
+    if (pageUsage == NULL)
+    {
+        pageUsage = malloc(page_max() * sizeof(pageusage));
+        assert(pageUsage != NULL);
+    }
+
+    pageUsage[page_index(newPage->ptr)].sizeClass = index;
+    pageUsage[page_index(newPage->ptr)].used = 0;
+
+    //push from the end of the page so the list hands out blocks in
+    //address order
+    void* block = newPage->ptr + PAGE_SIZE - blockSize;
+    while (block >= newPage->ptr)
+    {
+        push_block(index, (freeblock*)block);
+        block -= blockSize;
+    }
+}
+
+void push_block(int index, freeblock* block)
+{
+    block->prev = NULL;
+    block->next = freeLists[index];
+    if (freeLists[index] != NULL)
+    {
+        freeLists[index]->prev = block;
+    }
+    freeLists[index] = block;
+}
+
+void unlink_block(int index, freeblock* block)
+{
+    if (block->prev != NULL)
+    {
+        ((freeblock*)block->prev)->next = block->next;
+    }
+    else
+    {
+        freeLists[index] = block->next;
+    }
+
+    if (block->next != NULL)
+    {
+        ((freeblock*)block->next)->prev = block->prev;
+    }
+}
+
+void release_page(void* page)
+{
+    //every block of the page is free, so take them all off the list
+    //before giving the page back
+    int index = pageUsage[page_index(page)].sizeClass;
+    kma_size_t blockSize = MIN_SIZE << index;
+    void* block;
+
+    for (block = page; block < page + PAGE_SIZE; block += blockSize)
+    {
+        unlink_block(index, (freeblock*)block);
+    }
+
+    free_page(page_lookup(page));
+}
+
+void release_empty_pages()
+{
+    int index;
+
+    for (index = 0; index < NUM_CLASSES; index++)
+    {
+        if (emptyPages[index] != NULL)
+        {
+            release_page(emptyPages[index]);
+            emptyPages[index] = NULL;
+        }
+    }
 }
 
 #endif // KMA_P2FL
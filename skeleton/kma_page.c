@@ -55,10 +55,13 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_trace.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -67,118 +70,1052 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// single pages a thread keeps for itself. it refills and drains half of
+// them at a time under the pool lock
+#define PAGE_CACHE_PAGES 16
+
+// map entry of a page taken from the pool that sits in a thread's cache.
+// the pool only sees it as not free
+#define PAGE_CACHED ((kma_page_t*) -1)
+
+// pages made usable at a time when the pool grows
+#define POOL_CHUNK 256
+
+// length of a run of free pages that is given back to the OS
+#define POOL_RELEASE 64
+
+// size of a huge page, the pool is aligned to it when huge pages are on
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define HUGEPAGE_PAGES (HUGEPAGE_SIZE / PAGESIZE)
+
+// how free pages below the top are found, pick one with -DPAGE_POLICY=...
+// SIZE_BINS takes a run from the bin of its length, ADDRESS_ORDER always
+// takes the lowest free pages of the pool
+#define SIZE_BINS 0
+#define ADDRESS_ORDER 1
+
+#ifndef PAGE_POLICY
+#define PAGE_POLICY SIZE_BINS
+#endif
+
+#if PAGE_POLICY == ADDRESS_ORDER
+// one bit per page of the pool, set while the page is free below the top.
+// a summary bit is set for every word of the bitmap with a free page
+#define BITS_WORD 64
+#define BITMAP_WORDS(bits) (((bits) + BITS_WORD - 1) / BITS_WORD)
+#else
+// free runs are kept in bins by length: bin 0 holds single pages and
+// bin b holds runs of 2^(b-1)+1 up to 2^b pages
+#define RUN_BINS 32
+#endif
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE, 0, 0 };
+
+// everything about the pool below is only touched under this lock, and
+// so are the request counters
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// page numbers cached by the calling thread, and the pages it got from
+// and gave back to its cache since it last added them to the counters
+static __thread int page_cache[PAGE_CACHE_PAGES];
+static __thread int page_cache_count = 0;
+static __thread int page_cache_requested = 0;
+static __thread int page_cache_freed = 0;
+
+// pages handed out by the pool or held by a cache. the pool is not torn
+// down while any thread has some
+static int pool_out = 0;
+
+// drains the cache of a thread when it exits
+static pthread_key_t page_cache_key;
+static pthread_once_t page_cache_once = PTHREAD_ONCE_INIT;
 
 static void* pool = NULL;
-static void* next_free_page = NULL;
+
+// the whole pool is reserved up front so it never moves, but pages are
+// only made usable chunk by chunk. pool_max_pages is 0 until configured
+static void* pool_mapping = NULL;
+static size_t pool_mapping_size = 0;
+static int pool_max_pages = 0;
+static int pool_chunk_pages = 0;
+
+// set once page_max() was asked or a pool was made. allocators size
+// per-page arrays from it, so the maximum cannot change any more
+static int pool_max_fixed = 0;
+static int pool_committed_pages = 0;
+
+// pages from pool_top up were never handed out, or came back at the top
+// of the pool. they are not in any run and are handed out by moving the
+// mark up. from pool_clean up none of them holds memory any more
+static int pool_top = 0;
+static int pool_clean = 0;
+
+// free runs at least this long are given back with madvise, 0 never
+// gives anything back and -1 means not configured yet
+static int pool_release_pages = -1;
+
+// PAGE_HUGE_NONE, PAGE_HUGE_THP or PAGE_HUGE_TLB, -1 until configured.
+// pool_huge_mode is what the pool actually got
+static int pool_huge_pages = -1;
+static int pool_huge_mode = PAGE_HUGE_NONE;
+
+// reverse map from page number to page structure and owner. the map
+// holds the page structures of the runs handed out, and the free runs:
+// their length at both ends and the bin links at the first page
+static kma_page_map_t* page_map = NULL;
+
+#if PAGE_POLICY == ADDRESS_ORDER
+// free page bitmap and its summary, mapped like the page map
+static uint64_t* free_bits = NULL;
+static uint64_t* free_summary = NULL;
+#else
+// first page of the first free run in every bin, -1 if the bin is
+// empty. bit b of run_mask is set while run_bins[b] is not empty
+static int run_bins[RUN_BINS];
+static unsigned int run_mask = 0;
+#endif
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+int cachePop();
+int cachePush(int);
+void cacheFill();
+void cacheDrain(int);
+void cacheCount();
+void cacheExit(void*);
+void cacheKey();
+void* allocPages(int);
+void freePages(void*, int);
+void destroyPool();
 void initPages();
+int growPool();
+void configPool();
+int takeRun(int);
+void addRun(int, int);
+void lowerTop(int);
+#if PAGE_POLICY == ADDRESS_ORDER
+int nextFree(int);
+int freeEnd(int, int);
+int freeStart(int);
+void markPages(int, int, int);
+#else
+void insertRun(int, int);
+void removeRun(int);
+int findRun(int);
+int runBin(int);
+#endif
+void releasePages(int, int);
+void releaseHuge(int, int, int, int);
+void reservePool();
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
 kma_page_t* get_page()
+{
+  return get_pages(1);
+}
+
+kma_page_t* get_pages(int n)
 {
   static int id = 0;
   kma_page_t* res;
+  void* ptr;
+  int first;
+  int i;
+  
+  assert(n > 0);
+  
+  // single pages come from the cache of the thread without the lock,
+  // and are counted when the thread takes the lock next
+  page_cache_requested += n;
+  if (n == 1 && (first = cachePop()) >= 0)
+    {
+      ptr = pool + (size_t) first * PAGESIZE;
+    }
+  else
+    {
+      pthread_mutex_lock(&pool_lock);
+      cacheCount();
+      if (n == 1)
+	{
+	  cacheFill();
+	  ptr = pool + (size_t) cachePop() * PAGESIZE;
+	}
+      else
+	{
+	  ptr = allocPages(n);
+	}
+      pthread_mutex_unlock(&pool_lock);
+    }
+  
+  assert(ptr != NULL);
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  // the structure lives in the map entry of the first page of the run,
+  // and every page of the run maps back to it
+  res = &page_map[page_index(ptr)].desc;
+  res->id = __atomic_fetch_add(&id, 1, __ATOMIC_RELAXED);
+  res->size = n * kma_page_stats.page_size;
+  res->ptr = ptr;
+  res->heap = -1;
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  // the pool reads the entries of neighbouring pages under its lock
+  for (i = page_index(res->ptr); i < page_index(res->ptr) + n; i++)
+    {
+      __atomic_store_n(&page_map[i].page, res, __ATOMIC_RELAXED);
+      page_map[i].owner = NULL;
+    }
   
-  assert(res->ptr != NULL);
+  TRACE(TRACE_GET_PAGE, res->ptr, res->size);
   
   return res;	
 }
 
 void free_page(kma_page_t* ptr)
 {
+  assert(ptr != NULL);
+  
+  free_pages(ptr, ptr->size / PAGESIZE);
+}
+
+void free_pages(kma_page_t* ptr, int n)
+{
+  int first;
+  int i;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  assert(ptr->size == n * PAGESIZE);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  TRACE(TRACE_FREE_PAGE, ptr->ptr, ptr->size);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  first = page_index(ptr->ptr);
+  for (i = first; i < first + n; i++)
+    {
+      __atomic_store_n(&page_map[i].page, PAGE_CACHED, __ATOMIC_RELAXED);
+      page_map[i].owner = NULL;
+    }
+  
+  // the structure is part of the map, nothing to free. a single page
+  // stays with the thread, and half of a full cache goes back first.
+  // the thread counts the pages it frees until it takes the lock
+  page_cache_freed += n;
+  if (n == 1 && !cachePush(first))
+    {
+      pthread_mutex_lock(&pool_lock);
+      cacheDrain(PAGE_CACHE_PAGES / 2);
+      cacheCount();
+      pthread_mutex_unlock(&pool_lock);
+      cachePush(first);
+    }
+  else if (n > 1)
+    {
+      pthread_mutex_lock(&pool_lock);
+      freePages(ptr->ptr, n);
+      cacheCount();
+      pthread_mutex_unlock(&pool_lock);
+    }
+  
+  // the last page in use as far as this thread can tell. the pool goes
+  // away once every cache is empty
+  if (__atomic_load_n(&kma_page_stats.num_in_use, __ATOMIC_RELAXED)
+      + page_cache_requested - page_cache_freed == 0)
+    {
+      pthread_mutex_lock(&pool_lock);
+      cacheDrain(page_cache_count);
+      cacheCount();
+      destroyPool();
+      pthread_mutex_unlock(&pool_lock);
+    }
 }
 
 kma_page_stat_t* page_stats()
 {
   static kma_page_stat_t stats;
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  // with the pages the calling thread has not counted yet
+  memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  stats.num_requested += page_cache_requested;
+  stats.num_freed += page_cache_freed;
+  stats.num_in_use += page_cache_requested - page_cache_freed;
+  return &stats;
+}
+
+int page_index(void* ptr)
+{
+  assert(pool != NULL);
+  assert(ptr >= pool && ptr < pool + (size_t) pool_max_pages * PAGESIZE);
+  
+  return (ptr - pool) / PAGESIZE;
+}
+
+kma_page_t* page_lookup(void* ptr)
+{
+  kma_page_t* page = page_map[page_index(ptr)].page;
+  
+  return page == PAGE_CACHED ? NULL : page;
+}
+
+void page_set_owner(kma_page_t* page, void* owner)
+{
+  assert(page != NULL);
+  assert(page_map[page_index(page->ptr)].page == page);
+  
+  page_map[page_index(page->ptr)].owner = owner;
+}
+
+void* page_owner(void* ptr)
+{
+  return page_map[page_index(ptr)].owner;
+}
+
+void page_release_init(int run_pages)
+{
+  pthread_mutex_lock(&pool_lock);
+  pool_release_pages = run_pages > 0 ? run_pages : 0;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void page_huge_init(int mode)
+{
+  // the backing of the pool is picked when it is mapped
+  assert(pool == NULL);
+  
+  pool_huge_pages = mode;
+}
+
+int page_huge_mode()
+{
+  return pool_huge_mode;
+}
+
+void page_pool_init(int max_pages, int chunk_pages)
+{
+  // the pool cannot change size under pages that are handed out
+  assert(pool == NULL);
+  
+  max_pages = max_pages > 0 ? max_pages : MAXPAGES;
+  if (pool_max_fixed && max_pages != pool_max_pages)
+    {
+      error("the pool size cannot change after its first use",
+	    "page_pool_init");
+    }
+  pool_max_pages = max_pages;
+  pool_chunk_pages = chunk_pages > 0 ? chunk_pages : POOL_CHUNK;
+}
+
+int page_max()
+{
+  if (pool_max_pages == 0)
+    {
+      configPool();
+    }
+  pool_max_fixed = 1;
+  
+  return pool_max_pages;
 }
 
-void* allocPage()
+void* allocPages(int n)
 {
-  void* res;
+  int first;
+  int i;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
+  if ((first = takeRun(n)) < 0)
+    {
+      // no run fits, take fresh pages from the top and grow the pool
+      // when they run out
+      while (pool_top + n > pool_committed_pages)
+	{
+	  if (!growPool())
+	    {
+	      char max[64];
+	      
+	      snprintf(max, sizeof(max), "pool of %d pages, see KMA_POOL_PAGES",
+		       pool_max_pages);
+	      error("error: all pages already allocated", max);
+	    }
+	}
+      first = pool_top;
+      pool_top += n;
+      if (pool_clean < pool_top)
+	{
+	  pool_clean = pool_top;
+	}
+    }
   
-  if (res == NULL)
+  pool_out += n;
+  for (i = first; i < first + n; i++)
     {
-      error("error: all pages already allocated", "");
+      if (page_map[i].state == PAGE_RELEASED)
+	{
+	  // it comes back as a zero page on first touch
+	  kma_page_stats.num_released--;
+	}
+      page_map[i].state = PAGE_RESIDENT;
+      page_map[i].page = PAGE_CACHED;
     }
   
-  next_free_page = *((void**)next_free_page);
+  return pool + (size_t) first * PAGESIZE;
+}
+
+void freePages(void* ptr, int n)
+{
+  int first = page_index(ptr);
+  int i;
   
-  assert(res != NULL);
+  pool_out -= n;
+  for (i = first; i < first + n; i++)
+    {
+      page_map[i].page = NULL;
+    }
   
-  return res;
+  addRun(first, n);
 }
 
-void freePage(void* ptr)
+void destroyPool()
 {
-  assert(ptr != NULL);
+  // pages in use or cached by any thread keep the pool
+  if (pool == NULL || pool_out != 0)
+    {
+      return;
+    }
+  
+  munmap(pool_mapping, pool_mapping_size);
+  munmap(page_map, (size_t) pool_max_pages * sizeof(kma_page_map_t));
+  pool = NULL;
+  pool_mapping = NULL;
+  page_map = NULL;
+  pool_committed_pages = 0;
+  pool_top = 0;
+  pool_clean = 0;
+#if PAGE_POLICY == ADDRESS_ORDER
+  munmap(free_bits, BITMAP_WORDS(pool_max_pages) * sizeof(uint64_t));
+  munmap(free_summary, BITMAP_WORDS(BITMAP_WORDS(pool_max_pages)) * sizeof(uint64_t));
+  free_bits = NULL;
+  free_summary = NULL;
+#endif
+}
+
+int cachePop()
+{
+  if (page_cache_count == 0)
+    {
+      return -1;
+    }
+  
+  return page_cache[--page_cache_count];
+}
+
+int cachePush(int first)
+{
+  static __thread int registered = 0;
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  if (page_cache_count == PAGE_CACHE_PAGES)
+    {
+      return 0;
+    }
   
-  if (kma_page_stats.num_in_use == 0)
+  if (!registered)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      // any value but NULL makes the key run cacheExit() at thread exit
+      pthread_once(&page_cache_once, cacheKey);
+      pthread_setspecific(page_cache_key, page_cache);
+      registered = 1;
     }
+  
+  page_cache[page_cache_count++] = first;
+  return 1;
+}
+
+void cacheFill()
+{
+  int i;
+  
+  // called with the pool lock held
+  for (i = 0; i < PAGE_CACHE_PAGES / 2; i++)
+    {
+      cachePush(page_index(allocPages(1)));
+    }
+}
+
+void cacheDrain(int n)
+{
+  // called with the pool lock held
+  while (n-- > 0 && page_cache_count > 0)
+    {
+      freePages(pool + (size_t) cachePop() * PAGESIZE, 1);
+    }
+}
+
+void cacheCount()
+{
+  int in_use = page_cache_requested - page_cache_freed;
+  
+  // called with the pool lock held. the counters are read without it
+  __atomic_add_fetch(&kma_page_stats.num_requested, page_cache_requested,
+		     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&kma_page_stats.num_freed, page_cache_freed,
+		     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&kma_page_stats.num_in_use, in_use, __ATOMIC_RELAXED);
+  page_cache_requested = 0;
+  page_cache_freed = 0;
+}
+
+void cacheExit(void* arg)
+{
+  pthread_mutex_lock(&pool_lock);
+  cacheDrain(page_cache_count);
+  cacheCount();
+  destroyPool();
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void cacheKey()
+{
+  pthread_key_create(&page_cache_key, cacheExit);
 }
 
 void initPages()
 {
+#if PAGE_POLICY != ADDRESS_ORDER
   int i;
+#endif
   
-  assert(next_free_page == NULL);
   assert(pool == NULL);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  if (pool_max_pages == 0)
+    {
+      configPool();
+    }
+  pool_max_fixed = 1;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  if (pool_release_pages < 0)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      // KMA_RELEASE_PAGES sets the run length, 0 turns it off
+      char* run_pages = getenv("KMA_RELEASE_PAGES");
+      pool_release_pages = run_pages ? atoi(run_pages) : POOL_RELEASE;
+      if (pool_release_pages < 0)
+	{
+	  pool_release_pages = 0;
+	}
+    }
+  
+  reservePool();
+  
+  // the map is mapped the same way, so only entries of pages that were
+  // used ever take memory
+  page_map = mmap(NULL, (size_t) pool_max_pages * sizeof(kma_page_map_t),
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (page_map == MAP_FAILED)
+    error("Error using mmap to allocate the page map", "");
+  
+#if PAGE_POLICY == ADDRESS_ORDER
+  free_bits = mmap(NULL, BITMAP_WORDS(pool_max_pages) * sizeof(uint64_t),
+		   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  free_summary = mmap(NULL, BITMAP_WORDS(BITMAP_WORDS(pool_max_pages)) * sizeof(uint64_t),
+		      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (free_bits == MAP_FAILED || free_summary == MAP_FAILED)
+    error("Error using mmap to allocate the free page bitmap", "");
+#else
+  for (i = 0; i < RUN_BINS; i++)
+    {
+      run_bins[i] = -1;
+    }
+  run_mask = 0;
+#endif
+  
+  pool_committed_pages = 0;
+  pool_top = 0;
+  pool_clean = 0;
+}
+
+int growPool()
+{
+  int n = pool_chunk_pages;
+  int first = pool_committed_pages;
+  int i;
+  
+  if (pool_committed_pages + n > pool_max_pages)
+    {
+      n = pool_max_pages - pool_committed_pages;
+    }
+  if (n == 0)
+    {
+      return 0;
+    }
+  
+  // a hugetlb pool is usable from the start, it cannot be split up
+  void* chunk = pool + (size_t) first * PAGESIZE;
+  if (pool_huge_mode != PAGE_HUGE_TLB
+      && mprotect(chunk, (size_t) n * PAGESIZE, PROT_READ | PROT_WRITE))
+    {
+      error("Error using mprotect to grow the page pool", "");
+    }
+  pool_committed_pages += n;
+  
+  // the new pages are above the top and were never touched
+  for (i = first; i < first + n; i++)
+    {
+      page_map[i].page = NULL;
+      page_map[i].state = PAGE_UNTOUCHED;
+    }
+  
+  return 1;
+}
+
+void configPool()
+{
+  // KMA_POOL_PAGES caps the pool, KMA_POOL_CHUNK sets how many pages it
+  // grows by. both are in pages, and anything unset or invalid gets the
+  // default
+  char* max_pages = getenv("KMA_POOL_PAGES");
+  char* chunk_pages = getenv("KMA_POOL_CHUNK");
+  
+  page_pool_init(max_pages ? atoi(max_pages) : 0,
+		 chunk_pages ? atoi(chunk_pages) : 0);
+}
+
+void reservePool()
+{
+  size_t size = (size_t) pool_max_pages * PAGESIZE;
+  size_t align = PAGESIZE;
+  
+  if (pool_huge_pages < 0)
+    {
+      // KMA_HUGE_PAGES is "thp" or "hugetlb", anything else is off
+      char* huge = getenv("KMA_HUGE_PAGES");
+      page_huge_init(huge == NULL ? PAGE_HUGE_NONE
+		     : strcmp(huge, "hugetlb") == 0 ? PAGE_HUGE_TLB
+		     : strcmp(huge, "thp") == 0 ? PAGE_HUGE_THP : PAGE_HUGE_NONE);
+    }
+  pool_huge_mode = pool_huge_pages;
+  
+#ifdef MAP_HUGETLB
+  if (pool_huge_mode == PAGE_HUGE_TLB)
+    {
+      // explicit huge pages come aligned and have to be mapped whole.
+      // they are reserved up front, without that a missing huge page
+      // is a SIGBUS on first touch instead of a failed mmap. they
+      // cannot be released in pieces either
+      pool_mapping_size = (size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+      pool_mapping = mmap(NULL, pool_mapping_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (pool_mapping != MAP_FAILED)
+	{
+	  pool = pool_mapping;
+	  return;
+	}
+      // no huge pages set aside, fall back to transparent ones
+      pool_huge_mode = PAGE_HUGE_THP;
+    }
+#else
+  if (pool_huge_mode == PAGE_HUGE_TLB)
+    {
+      pool_huge_mode = PAGE_HUGE_THP;
+    }
+#endif
+  
+  if (pool_huge_mode == PAGE_HUGE_THP)
+    {
+      align = HUGEPAGE_SIZE;
+    }
+  
+  // reserve address space only, with room to align the pool
+  pool_mapping_size = size + align;
+  pool_mapping = mmap(NULL, pool_mapping_size, PROT_NONE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pool_mapping == MAP_FAILED)
+    error("Error using mmap to reserve the page pool", "");
+  pool = (void*) (((uintptr_t) pool_mapping + align - 1) & ~(uintptr_t)(align - 1));
+  
+#ifdef MADV_HUGEPAGE
+  if (pool_huge_mode == PAGE_HUGE_THP && madvise(pool, size, MADV_HUGEPAGE))
+    {
+      pool_huge_mode = PAGE_HUGE_NONE;
+    }
+#else
+  pool_huge_mode = PAGE_HUGE_NONE;
+#endif
+}
+
+void lowerTop(int top)
+{
+  pool_top = top;
+  
+  // once enough pages above the top hold memory they are given back,
+  // whatever order they came back in
+  if (pool_release_pages > 0 && pool_huge_mode == PAGE_HUGE_THP)
+    {
+      // only whole huge pages, the one the top is in stays
+      int clean = (pool_top + HUGEPAGE_PAGES - 1) & ~(HUGEPAGE_PAGES - 1);
       
-      *((void**) ptr) = next;
+      if (clean < pool_clean)
+	{
+	  releasePages(clean, pool_clean - clean);
+	  pool_clean = clean;
+	}
+    }
+  else if (pool_release_pages > 0 && pool_huge_mode != PAGE_HUGE_TLB
+	   && pool_clean - pool_top >= pool_release_pages)
+    {
+      releasePages(pool_top, pool_clean - pool_top);
+      pool_clean = pool_top;
+    }
+}
+
+#if PAGE_POLICY == ADDRESS_ORDER
+int takeRun(int n)
+{
+  int first = nextFree(0);
+  int end;
+  
+  // the lowest free page that starts n free pages in a row
+  while (first >= 0)
+    {
+      end = freeEnd(first, first + n);
+      if (end == first + n)
+	{
+	  markPages(first, n, 0);
+	  return first;
+	}
+      first = nextFree(end);
+    }
+  
+  return -1;
+}
+
+void addRun(int first, int length)
+{
+  int top;
+  
+  if (first + length < pool_top)
+    {
+      markPages(first, length, 1);
+      return;
+    }
+  
+  // the run ends at the top, so it goes back above it with the free
+  // pages right below it. holes further down are never given back, but
+  // they are reused first and the free tail is what remains
+  top = freeStart(first);
+  markPages(top, first - top, 0);
+  lowerTop(top);
+}
+
+int nextFree(int from)
+{
+  int word = from / BITS_WORD;
+  int s;
+  uint64_t bits;
+  uint64_t summary;
+  
+  if (from >= pool_top)
+    {
+      return -1;
+    }
+  
+  bits = free_bits[word] & (~(uint64_t) 0 << (from % BITS_WORD));
+  if (bits)
+    {
+      return word * BITS_WORD + __builtin_ctzll(bits);
+    }
+  
+  // the summary finds the next word with a free page. there are none
+  // above the top
+  word++;
+  for (s = word / BITS_WORD; s < BITMAP_WORDS(BITMAP_WORDS(pool_top)); s++)
+    {
+      summary = free_summary[s];
+      if (s == word / BITS_WORD)
+	{
+	  summary &= ~(uint64_t) 0 << (word % BITS_WORD);
+	}
+      if (summary)
+	{
+	  word = s * BITS_WORD + __builtin_ctzll(summary);
+	  return word * BITS_WORD + __builtin_ctzll(free_bits[word]);
+	}
+    }
+  
+  return -1;
+}
+
+// the end of the free pages from i on, looked at up to limit. a whole
+// word is checked at a time, the bits above the top are never set
+int freeEnd(int i, int limit)
+{
+  int word = i / BITS_WORD;
+  uint64_t used = ~free_bits[word] & (~(uint64_t) 0 << (i % BITS_WORD));
+  
+  while (used == 0 && (word + 1) * BITS_WORD < limit)
+    {
+      used = ~free_bits[++word];
+    }
+  if (used == 0)
+    {
+      return limit;
+    }
+  
+  i = word * BITS_WORD + __builtin_ctzll(used);
+  return i < limit ? i : limit;
+}
+
+// the start of the free pages that end right below i
+int freeStart(int i)
+{
+  int word;
+  uint64_t used;
+  
+  if (i == 0)
+    {
+      return 0;
+    }
+  
+  word = (i - 1) / BITS_WORD;
+  used = ~free_bits[word] & (~(uint64_t) 0 >> (BITS_WORD - 1 - (i - 1) % BITS_WORD));
+  while (used == 0 && word > 0)
+    {
+      used = ~free_bits[--word];
+    }
+  if (used == 0)
+    {
+      return 0;
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  return word * BITS_WORD + BITS_WORD - __builtin_clzll(used);
+}
+
+void markPages(int first, int length, int free)
+{
+  int end = first + length;
+  int word;
+  uint64_t mask;
+  
+  if (length <= 0)
+    {
+      return;
+    }
+  
+  // a mask of the run's bits in each word it covers
+  for (word = first / BITS_WORD; word * BITS_WORD < end; word++)
+    {
+      mask = ~(uint64_t) 0;
+      if (word == first / BITS_WORD)
+	{
+	  mask &= ~(uint64_t) 0 << (first % BITS_WORD);
+	}
+      if (word == (end - 1) / BITS_WORD)
+	{
+	  mask &= ~(uint64_t) 0 >> (BITS_WORD - 1 - (end - 1) % BITS_WORD);
+	}
+      
+      if (free)
+	{
+	  free_bits[word] |= mask;
+	  free_summary[word / BITS_WORD] |= (uint64_t) 1 << (word % BITS_WORD);
+	}
+      else
+	{
+	  free_bits[word] &= ~mask;
+	  if (free_bits[word] == 0)
+	    {
+	      free_summary[word / BITS_WORD] &= ~((uint64_t) 1 << (word % BITS_WORD));
+	    }
+	}
+    }
+}
+#else
+int takeRun(int n)
+{
+  int first = findRun(n);
+  int length;
+  
+  if (first < 0)
+    {
+      return -1;
+    }
+  
+  // hand out the front of the run and keep the rest free
+  length = page_map[first].run_length;
+  removeRun(first);
+  if (length > n)
+    {
+      insertRun(first + n, length - n);
+    }
+  
+  return first;
+}
+
+void addRun(int first, int length)
+{
+  int left = 0;
+  int right = 0;
+  
+  // merge with the free runs right before and right after. the page
+  // before ends a run and the page after starts one, and both ends of
+  // a run know its length
+  if (first > 0 && __atomic_load_n(&page_map[first - 1].page, __ATOMIC_RELAXED) == NULL)
+    {
+      left = page_map[first - 1].run_length;
+      removeRun(first - left);
+    }
+  if (first + length < pool_top
+      && __atomic_load_n(&page_map[first + length].page, __ATOMIC_RELAXED) == NULL)
+    {
+      right = page_map[first + length].run_length;
+      removeRun(first + length);
+    }
+  
+  // a run that ends at the top goes back above it
+  if (first + length + right == pool_top)
+    {
+      lowerTop(first - left);
+      return;
+    }
+  
+  // a run that reaches the threshold goes back to the OS. the parts that
+  // were already that long went back when they got there, so only the
+  // shorter ones are scanned
+  if (pool_release_pages > 0 && pool_huge_mode == PAGE_HUGE_THP)
+    {
+      releaseHuge(first - left, left + length + right, first, length);
+    }
+  else if (pool_release_pages > 0 && pool_huge_mode != PAGE_HUGE_TLB
+	   && left + length + right >= pool_release_pages)
+    {
+      if (left < pool_release_pages)
+	{
+	  releasePages(first - left, left);
+	}
+      releasePages(first, length);
+      if (right < pool_release_pages)
+	{
+	  releasePages(first + length, right);
+	}
+    }
+  
+  insertRun(first - left, left + length + right);
+}
+
+void insertRun(int first, int length)
+{
+  int bin = runBin(length);
+  
+  page_map[first].run_length = length;
+  page_map[first + length - 1].run_length = length;
+  
+  page_map[first].run_prev = -1;
+  page_map[first].run_next = run_bins[bin];
+  if (run_bins[bin] >= 0)
+    {
+      page_map[run_bins[bin]].run_prev = first;
+    }
+  run_bins[bin] = first;
+  run_mask |= 1u << bin;
+}
+
+void removeRun(int first)
+{
+  int bin = runBin(page_map[first].run_length);
+  int prev = page_map[first].run_prev;
+  int next = page_map[first].run_next;
+  
+  if (prev >= 0)
+    {
+      page_map[prev].run_next = next;
+    }
+  else
+    {
+      run_bins[bin] = next;
+      if (next < 0)
+	{
+	  run_mask &= ~(1u << bin);
+	}
+    }
+  if (next >= 0)
+    {
+      page_map[next].run_prev = prev;
+    }
+}
+
+int findRun(int n)
+{
+  int bin = runBin(n);
+  int first;
+  unsigned int larger;
+  
+  // runs in the bin of n may be shorter than n, so look for one that fits
+  for (first = run_bins[bin]; first >= 0; first = page_map[first].run_next)
+    {
+      if (page_map[first].run_length >= n)
+	{
+	  return first;
+	}
+    }
+  
+  // any run in a larger bin fits
+  larger = run_mask & ~((2u << bin) - 1);
+  if (larger == 0)
+    {
+      return -1;
+    }
+  return run_bins[__builtin_ctz(larger)];
+}
+
+int runBin(int length)
+{
+  return length == 1 ? 0 : 32 - __builtin_clz(length - 1);
+}
+#endif
+
+void releaseHuge(int run, int run_length, int first, int length)
+{
+  int huge;
+  
+  // giving back part of a transparent huge page splits it, so only huge
+  // pages the whole run covers go back. those not touched by the freed
+  // pages were covered before and already went back
+  for (huge = first & ~(HUGEPAGE_PAGES - 1); huge < first + length;
+       huge += HUGEPAGE_PAGES)
+    {
+      if (huge >= run && huge + HUGEPAGE_PAGES <= run + run_length)
+	{
+	  releasePages(huge, HUGEPAGE_PAGES);
+	}
+    }
+}
+
+void releasePages(int first, int length)
+{
+  int i = first;
+  
+  // madvise every stretch of pages that still holds memory
+  while (i < first + length)
+    {
+      int start;
+      
+      while (i < first + length && page_map[i].state != PAGE_RESIDENT)
+	{
+	  i++;
+	}
+      start = i;
+      while (i < first + length && page_map[i].state == PAGE_RESIDENT)
+	{
+	  page_map[i].state = PAGE_RELEASED;
+	  i++;
+	}
+      if (i > start)
+	{
+	  madvise(pool + (size_t) start * PAGESIZE, (size_t) (i - start) * PAGESIZE,
+		  MADV_DONTNEED);
+	  kma_page_stats.num_released += i - start;
+	  kma_page_stats.bytes_released += (long) (i - start) * PAGESIZE;
+	}
+    }
 }
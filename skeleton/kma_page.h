@@ -54,6 +54,7 @@
 #define __KPAGE_H__
 
 /************System include***********************************************/
+#include <stdint.h>
 
 /************Private include**********************************************/
 
@@ -73,7 +74,9 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+/* default maximum size of the pool, see page_pool_init(). it is only
+ * reserved address space until pages are used */
+#define MAXPAGES 65536
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -83,21 +86,48 @@
  *    Input: pointer
  *    Output: the base address of the page
  ***********************************************************************/
-#define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
+#define BASEADDR(x) ((void*)(((uintptr_t) (x)) & ~(uintptr_t)(PAGESIZE-1)))
 
 typedef struct
 {
   int id;
   void* ptr;
   int size;
+  int heap;  /* the allocator's owner of the page, such as its arena or
+	      * thread, read by any thread freeing into it. -1 until set */
 } kma_page_t;
 
+/* how the pool is backed, see page_huge_init() */
+#define PAGE_HUGE_NONE 0
+#define PAGE_HUGE_THP  1
+#define PAGE_HUGE_TLB  2
+
+/* what a free page holds, see kma_page_map_t */
+#define PAGE_RESIDENT  0
+#define PAGE_RELEASED  1
+#define PAGE_UNTOUCHED 2
+
+/* entry of the page layer's reverse map: one per page of the pool,
+ * indexed by page number. free pages form runs of neighbouring pages */
+typedef struct
+{
+  kma_page_t desc;  /* page structure of a run starting at this page */
+  kma_page_t* page;
+  void* owner;
+  int run_length;   /* pages in the free run, set at its first and last page */
+  int run_next;     /* first page of the next and previous free run of */
+  int run_prev;     /* about the same length, -1 for none */
+  int state;        /* PAGE_RESIDENT, PAGE_RELEASED or PAGE_UNTOUCHED */
+} kma_page_map_t;
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_released;     /* free pages currently given back to the OS */
+  long bytes_released;  /* total bytes ever given back to the OS */
 } kma_page_stat_t;
 
 /************Global Variables*********************************************/
@@ -107,30 +137,163 @@ typedef struct
 /***********************************************************************
  *  Title: Allocates a memory page
  * ---------------------------------------------------------------------
- *    Purpose: Allocates a memory page
+ *    Purpose: Allocates a memory page. Safe to call from any thread;
+ *             single pages come from a small cache of the calling
+ *             thread, which only takes the pool lock to refill
  *    Input: none
- *    Output: the allocated memory page
+ *    Output: the allocated memory page. The structure belongs to the
+ *            page layer and is only valid until the page is released
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
- *    Purpose: Releases a memory page
+ *    Purpose: Releases a memory page, into the cache of the calling
+ *             thread if it has room. Any thread may release it
  *    Input: the pointer to the memory page structure
  *    Output: none
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of neighbouring memory pages, for
+ *             objects larger than a page. Every page of the run maps
+ *             back to the returned structure with page_lookup()
+ *    Input: number of pages
+ *    Output: the page structure of the run, its size is n pages
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of pages from get_pages(). free_page()
+ *             does the same for any page structure
+ *    Input: the page structure, number of pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*, int);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
  *    Purpose: Get the memory page statistics
  *    Input: none 
- *    Output: the memory page statistics in a static buffer
+ *    Output: the memory page statistics in a static buffer, not
+ *            synchronised with other threads. pages other threads
+ *            took from or gave to their caches are counted when they
+ *            next take the pool lock or exit
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Page number of a pointer
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the index of the pool page containing a pointer
+ *    Input: any pointer into an allocated page
+ *    Output: the page number within the pool
+ ***********************************************************************/
+EXTERN int page_index(void*);
+
+/***********************************************************************
+ *  Title: Reverse page lookup
+ * ---------------------------------------------------------------------
+ *    Purpose: Map a pointer back to the page structure returned by
+ *             get_page() in constant time
+ *    Input: any pointer into an allocated page
+ *    Output: the page structure, or NULL if the page is not in use
+ ***********************************************************************/
+EXTERN kma_page_t* page_lookup(void*);
+
+/***********************************************************************
+ *  Title: Set the page owner
+ * ---------------------------------------------------------------------
+ *    Purpose: Attach allocator specific metadata to a page. The
+ *             owner is cleared when the page is freed.
+ *    Input: the page structure, the owner metadata
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_set_owner(kma_page_t*, void*);
+
+/***********************************************************************
+ *  Title: Get the page owner
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the metadata attached with page_set_owner()
+ *    Input: any pointer into an allocated page
+ *    Output: the owner metadata, or NULL if none was set
+ ***********************************************************************/
+EXTERN void* page_owner(void*);
+
+/***********************************************************************
+ *  Title: Configure the page pool
+ * ---------------------------------------------------------------------
+ *    Purpose: Set the maximum number of pages in the pool and how many
+ *             pages it grows by at a time. Only address space for the
+ *             maximum is reserved; pages are made usable as the pool
+ *             grows and never move. Must be called while no page is
+ *             in use. The maximum cannot change once page_max() was
+ *             called or a page was handed out, since allocators size
+ *             per-page arrays from it. Without this call the
+ *             KMA_POOL_PAGES and KMA_POOL_CHUNK environment variables
+ *             are used
+ *    Input: maximum pages, pages per growth step (0 for the defaults)
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_pool_init(int, int);
+
+/***********************************************************************
+ *  Title: Configure page release
+ * ---------------------------------------------------------------------
+ *    Purpose: Set how long a run of free pages must get before it is
+ *             given back to the OS with madvise. The pages stay in the
+ *             pool and come back zeroed when they are handed out again.
+ *             Without this call the KMA_RELEASE_PAGES environment
+ *             variable is used
+ *    Input: run length in pages, 0 to never give pages back
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_release_init(int);
+
+/***********************************************************************
+ *  Title: Configure huge pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Back the pool with 2 MB pages: transparent huge pages
+ *             (PAGE_HUGE_THP) or explicit hugetlb pages (PAGE_HUGE_TLB),
+ *             which fall back to transparent ones when none are set
+ *             aside. A hugetlb pool maps its whole maximum up front
+ *             and is never released to the OS, and
+ *             transparent ones only in whole free huge pages. Must
+ *             be called while no page is in use. Without this call the
+ *             KMA_HUGE_PAGES environment variable ("thp" or "hugetlb")
+ *             is used
+ *    Input: PAGE_HUGE_NONE, PAGE_HUGE_THP or PAGE_HUGE_TLB
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_huge_init(int);
+
+/***********************************************************************
+ *  Title: Huge page mode
+ * ---------------------------------------------------------------------
+ *    Purpose: Get how the current pool is actually backed, after any
+ *             fallback
+ *    Input: none
+ *    Output: PAGE_HUGE_NONE, PAGE_HUGE_THP or PAGE_HUGE_TLB
+ ***********************************************************************/
+EXTERN int page_huge_mode();
+
+/***********************************************************************
+ *  Title: Maximum pool size
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the maximum number of pages in the pool, the bound
+ *             on page_index()
+ *    Input: none
+ *    Output: the maximum number of pages
+ ***********************************************************************/
+EXTERN int page_max();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -48,6 +48,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -61,30 +62,98 @@
  */
 #define PAGE_SIZE 8192
 
-  
+//block sizes are kept multiples of this so headers stay aligned
+#define ALIGNMENT 8
+
+//placement policies for the free list, pick one with -DRM_POLICY=...
+#define FIRST_FIT 0
+#define NEXT_FIT 1
+#define BEST_FIT 2
+
+#ifndef RM_POLICY
+#define RM_POLICY FIRST_FIT
+#endif
+
+#if RM_POLICY == BEST_FIT && !defined(RM_BEST_FIT_LIMIT)
+//best fit stops after looking at this many blocks that fit
+#define RM_BEST_FIT_LIMIT 16
+#endif
+
+#ifdef RM_SEGREGATED
+//free blocks are also kept in bins of [2^i, 2^(i+1)) bytes
+#define NUM_BINS 14
+#endif
+
+#ifdef RM_BOUNDARY_TAGS
+//flags of a block's boundary tag
+#define USED 1
+#define PREV_USED 2
+#endif
+
 typedef struct block_head
 {
   int size;
+#ifdef RM_BOUNDARY_TAGS
+  //size and flags are the boundary tag every block carries, free blocks
+  //repeat their size in the last int of the block
+  int flags;
+#endif
+  //free list in address order
   void* next;
-
+  void* prev;
+#ifdef RM_SEGREGATED
+  //free list of the size bin
+  void* binNext;
+  void* binPrev;
+#endif
 } blockheader;
 
 typedef struct page_header
 {
     kma_page_t* ptr;
     int counter;
-    int page_count;
     void* next;
+    void* prev;
+    //head of the free list, only used in the first page
     blockheader* blockHead;
-    int pageid;
+    //first and last free block of this page in the free list
+    blockheader* firstFree;
+    blockheader* lastFree;
 } pageheader;
 
+#ifdef RM_BOUNDARY_TAGS
+//allocated blocks keep the tag in front of the memory handed out
+#define TAG_SIZE ((kma_size_t)offsetof(blockheader, next))
+#define FOOTER(block) (*(int*)((void*)(block) + (block)->size - sizeof(int)))
+#define BLOCK_SIZE (sizeof(blockheader) + sizeof(int))
+#else
+#define TAG_SIZE 0
+#define BLOCK_SIZE sizeof(blockheader)
+#endif
+
+//smallest block we hand out, it has to hold a free block header
+#define MIN_BLOCK ((kma_size_t)((BLOCK_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1)))
+
 
 /************Global Variables*********************************************/
 
 //define a pointer kma_struct_t that points to the beginning of everything
 kma_page_t* globalPtr = NULL;
 
+//last page of the page list, new pages are linked in after it
+pageheader* tailPage = NULL;
+
+#if RM_POLICY == NEXT_FIT
+//where the next search starts
+blockheader* rover = NULL;
+#endif
+
+#ifdef RM_SEGREGATED
+//bins of free blocks and a bitmask of the bins that are not empty
+blockheader* bins[NUM_BINS] = { NULL };
+unsigned int binMask = 0;
+#endif
+
 
 /************Function Prototypes******************************************/
 void* kma_malloc(kma_size_t size);
@@ -92,8 +161,20 @@ void* findFreeBlock(kma_size_t size);
 void kma_free(void* ptr, kma_size_t size);
 void addToList(void* ptr,kma_size_t size);
 void freeMyPage(pageheader* page);
-void printPageList();
 void new_page(kma_page_t* newPage);
+kma_size_t adjustSize(kma_size_t size);
+void* take_block(blockheader* block, kma_size_t size);
+void remove_block(blockheader* block);
+blockheader* findPredecessor(pageheader* page, void* ptr);
+#ifdef RM_BOUNDARY_TAGS
+blockheader* coalesce(blockheader* block);
+#endif
+#ifdef RM_SEGREGATED
+int getBinIndex(kma_size_t size);
+void bin_insert(blockheader* block);
+void bin_remove(blockheader* block);
+blockheader* bin_search(kma_size_t size);
+#endif
 
 
 /************External Declaration*****************************************/
@@ -102,492 +183,536 @@ void new_page(kma_page_t* newPage);
 
 void* kma_malloc(kma_size_t size)
 {
-
     void* returnAddress = NULL;
 
-    //printf("THIS IS REQUEST NUMBER %d to allocate %d \n", lineCounter,size);
+    size = adjustSize(size + TAG_SIZE);
 
-    if ((size + sizeof(kma_page_t*)) > PAGE_SIZE)
-    {
-        return NULL;
-    }
-    //
-    if (size < sizeof(kma_page_t))
+    //a block can never be larger than a page minus its header, anything
+    //bigger gets a run of whole pages of its own
+    if (size > PAGE_SIZE - sizeof(pageheader))
     {
-        size = sizeof(kma_page_t);
+        return get_pages((size + PAGE_SIZE - 1) / PAGE_SIZE)->ptr;
     }
-    //
+
     if (globalPtr==NULL)
     {
-
-       // globalPtr = get_page();
         new_page(get_page());
     }
 
     returnAddress = findFreeBlock(size);
     if (returnAddress==NULL)
     {
-	//");
+        //nothing fits, get a new page and try again
         new_page(get_page());
+        returnAddress = findFreeBlock(size);
     }
-    else 
+
+    if (returnAddress==NULL)
     {
-        //printf("returnAddress %p \n",returnAddress);
-        return returnAddress;
+        return NULL;
     }
+    return returnAddress + TAG_SIZE;
+}
 
-    returnAddress = findFreeBlock(size);
-    //printf("returnaddress: %p \n",returnAddress);
-    return returnAddress;
+
+kma_size_t adjustSize(kma_size_t size)
+{
+    //every block has to be able to hold a free block header once freed
+    if (size < MIN_BLOCK)
+    {
+        size = MIN_BLOCK;
+    }
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
 }
 
 
 void new_page(kma_page_t* newPage)
 {
-    //printf("getting new page \n \n ");
-    //gets a pointer to a new page
-    //allocates a free block size of the page - header
-    //links the last block to the first new block
-    //copies information from the previous page
-    
-	pageheader* firstPage = NULL;
-	pageheader* previousPage = NULL;
-
-    *((kma_page_t**)newPage->ptr) = newPage;
-    pageheader* newPageHead;
-    newPageHead = (pageheader*) (newPage->ptr);
+    //initializes the header of a new page, links it at the end of the
+    //page list and puts everything after the header on the free list
+    pageheader* newPageHead = (pageheader*) (newPage->ptr);
     newPageHead->ptr = newPage;
     newPageHead->counter = 0;
     newPageHead->next = NULL;
+    newPageHead->prev = NULL;
     newPageHead->blockHead = NULL;
-    newPageHead->pageid = 0;
-
+    newPageHead->firstFree = NULL;
+    newPageHead->lastFree = NULL;
 
-    //link pages to each other
     if (globalPtr==NULL)
     {
-        globalPtr = (kma_page_t*)newPageHead->ptr;
+        globalPtr = newPage;
     }
-    else 
+    else
     {
-        firstPage = (pageheader*)(globalPtr->ptr);
-        previousPage = NULL;
-        while (firstPage!=NULL)
-        {
-//            printf("At page %p stepping to next page, (%p)\n",firstPage,firstPage->next);
-	    previousPage = firstPage;
- //           	printf("previousPage is %p\n",previousPage);
-		firstPage = firstPage->next;
-        }
-//	printf("Adding to %p \n",previousPage);
-        //now add to next one
-        newPageHead->pageid = (previousPage->pageid)+1;
-        previousPage->next = newPageHead;
-	//printf("Page %p -> %p \n",previousPage,previousPage->next);
-        newPageHead->blockHead = previousPage->blockHead;
-//	printf("id of previous: %d, id of new page: %d \n",previousPage->pageid,newPageHead->pageid);
-    }
-    //add to list a block of size pageSize - header at location page+pageheader
-    addToList((void*)((int)newPageHead+sizeof(pageheader)),(PAGE_SIZE-sizeof(pageheader)));
+        newPageHead->prev = tailPage;
+        tailPage->next = newPageHead;
+    }
+    tailPage = newPageHead;
+
+#ifdef RM_BOUNDARY_TAGS
+    //nothing in front of the first block can be merged with it
+    ((blockheader*)((void*)newPageHead + sizeof(pageheader)))->flags = PREV_USED;
+#endif
+
+    addToList((void*)newPageHead + sizeof(pageheader), PAGE_SIZE - sizeof(pageheader));
 }
 
 
 void* findFreeBlock(kma_size_t size)
 {
-//    printf("FindFreeBlock starts\n");
-    //if there's a list of stuff, look through it and find first fit 
-    blockheader* previous = NULL;
-    pageheader* pageHead;
-    //it's at the beginning of the list. make it point to the first free node
-    pageHead = (pageheader*) (globalPtr->ptr);
-    blockheader* current = pageHead->blockHead;
-    
-   // pageheader* currentPage = pageHead;
-    blockheader* returnAddr = NULL;
-    
-    kma_size_t oldSize;
-    blockheader* tempNext;
-
-    //printf("free block starts at %p\n",current); 
+#ifdef RM_SEGREGATED
+    //the bins find a fitting block without walking the whole list
+    blockheader* current = bin_search(size);
+    if (current!=NULL)
+    {
+        return take_block(current, size);
+    }
+#elif RM_POLICY == NEXT_FIT
+    //first fit starting where the last search stopped, wrapping around
+    //to the head of the list
+    pageheader* pageHead = (pageheader*) (globalPtr->ptr);
+    blockheader* start = (rover!=NULL) ? rover : pageHead->blockHead;
+    blockheader* current = start;
+
     while (current!=NULL)
     {
-       //currentPage = (pageheader*)(((int)current>>13)<<13);
-	  // printf("Page looked at: %p and counter is %d\n",currentPage,currentPage->counter);
-        //now go through the list and find a free block
         if (current->size >= size)
         {
-            returnAddr = current;
-            pageheader* returnPage = (pageheader*)(((int)current>>13)<<13);
-           // printf("Will add to page %p (counter: %d + 1)\n",returnPage,returnPage->counter);
-        	returnPage->counter++;
-		oldSize = current->size;
-
-            //if head of the blocks
-            if (previous==NULL)
+            //take_block leaves the rover on whatever is left of the block
+            return take_block(current, size);
+        }
+        current = (current->next!=NULL) ? current->next : pageHead->blockHead;
+        if (current==start)
+        {
+            break;
+        }
+    }
+#elif RM_POLICY == BEST_FIT
+    //smallest block that fits among the first few that do
+    pageheader* pageHead = (pageheader*) (globalPtr->ptr);
+    blockheader* current = pageHead->blockHead;
+    blockheader* best = NULL;
+    int candidates = 0;
+
+    while (current!=NULL && candidates < RM_BEST_FIT_LIMIT)
+    {
+        if (current->size >= size)
+        {
+            if (best==NULL || current->size < best->size)
             {
-                //change the ptr to the next free block
-                if (current->next==NULL){
-                    //only one block!    
-                    if (current->size - size < 8)
-			         {
-				        //need to skip remaining block, so point to nothing now
-				        pageHead->blockHead = NULL;
-			         }
-			         else
-			         {
-                        current = (void*)((int)(current)+size);
-                        current->size = oldSize - size;
-                        current->next = NULL;
-                        //update the head of list to this one
-                        pageHead->blockHead = current;
-                    }
-                    //and return the old address 
-      //              return (void*)returnAddr;
-                }
-                else 
-                {
-                    //you're at the beginning of your list and the list is more than one
-                    //you know it's big enough so just change its size and change the location of the header
-                   
-        		    if (current->size - size < 8)
-        		    {
-        			     pageHead->blockHead = current->next;
-        		    }
-        		    else
-        		    {
-        			    tempNext = current->next;
-                        current = (void*)((int)(current)+size);
-
-                   	    current->size = oldSize - size;
-                  	     current->next = tempNext;
-                   	    //no previous one so update header
-                   	    pageHead->blockHead = current;
-                   	    //add one to page counter
-                    }
-                    //nothing else to update
-        //            return (void*)returnAddr;
-                }
+                best = current;
             }
-            else 
+            if (current->size == size)
             {
-                //not at the head
-                //if you're at the tail
-                if (current->next==NULL)
-                {
-                    if (current->size - size < 8)
-                    {
-                        previous->next = NULL;
-                    }
-                    else
-                    {
-                       	 //add one node to the end 
-                        current = (void*)((int)(current)+size);
-
-                        //and replicate the size from the old size - size
-                        current->size = oldSize - size;
-                        current->next = NULL;
-                            
-                        //update the previous next to this one
-                        previous->next = current;
-                    }     
-
-                    //and return the old address 
-          //          return (void*)returnAddr;
-                }
-                else 
-                {
-                    //normal case, something in front and something behind
-            //        returnAddr = current;
-                    //if size of block is within accepted  to size+sizeof(blocknode)
-                    if (current->size-size<sizeof(blockheader)) //if the difference between them is smaller than what we need for a new node
-                    {
-                        //you lose a few things to fragmentation
-                        
-                        //take it out of the list
-                        previous->next = current->next;
-                        //and add 1 more
-              //          return (void*)returnAddr;
-                    }
-                    else 
-                    {
-                        //block is too big, so allocate new smaller block 
-                        //copy over (shift the free node)
-                        tempNext = current->next;
-                        current = (void*)((int)(current)+size);
-
-                        current->size = oldSize - size;
-                        current->next = tempNext;
-                        
-                        previous->next = current;
-                //        return (void*)returnAddr;
-                    }
-                }
+                //can't do better than that
+                break;
             }
-    //        printf("Shouldn't get here! , returning %p \n",returnAddr);
-        	return (void*)returnAddr;
-	}
-        else 
+            candidates++;
+        }
+        current = current->next;
+    }
+    if (best!=NULL)
+    {
+        return take_block(best, size);
+    }
+#else
+    //first fit over the address ordered list
+    pageheader* pageHead = (pageheader*) (globalPtr->ptr);
+    blockheader* current = pageHead->blockHead;
+
+    while (current!=NULL)
+    {
+        if (current->size >= size)
         {
-            //block is not good. step through
-            previous = current;
-            current = current->next;
-		//if (lineCounter>=199990){
-		//	printf("current: %p next: %p ",previous,current);
-		//}
+            return take_block(current, size);
         }
+        current = current->next;
     }
-   // printf("couldn't find a block. request new page!!! ******* \n");
-    return (void*)NULL; //no block found
+#endif
+    return NULL; //no block found
 }
 
-void kma_free(void* ptr, kma_size_t size)
+
+void* take_block(blockheader* block, kma_size_t size)
 {
+    //hands out the first size bytes of a free block. the rest of the block
+    //stays on the free list at the same position
+    pageheader* returnPage = (pageheader*)BASEADDR(block);
+    returnPage->counter++;
 
+    if (block->size - size < MIN_BLOCK)
+    {
+        //the rest is too small to hold a header, hand out the whole block
+        remove_block(block);
+#ifdef RM_BOUNDARY_TAGS
+        block->flags |= USED;
+        blockheader* after = (blockheader*)((void*)block + block->size);
+        if ((void*)after < (void*)returnPage + PAGE_SIZE)
+        {
+            after->flags |= PREV_USED;
+        }
+#endif
+        return (void*)block;
+    }
 
-    
-    //first need to add the requested memory location to the free list
-    addToList(ptr,size);
-    
-    //figure out what page we are decreasing from
-    pageheader* decreasePage = (pageheader*)(((int)ptr>>13)<<13);
-    //printf("Page %p counter %d decrement by 1\n",decreasePage,decreasePage->counter);
-    decreasePage->counter--;
-    if (decreasePage->counter==0)
+#ifdef RM_SEGREGATED
+    bin_remove(block);
+#endif
+
+    blockheader* rest = (blockheader*)((void*)block + size);
+    rest->size = block->size - size;
+    rest->next = block->next;
+    rest->prev = block->prev;
+
+    if (rest->prev!=NULL)
     {
-       // printf("Freeing page %p\n",decreasePage);
-        freeMyPage(decreasePage);
+        ((blockheader*)rest->prev)->next = rest;
+    }
+    else
+    {
+        ((pageheader*)(globalPtr->ptr))->blockHead = rest;
     }
+    if (rest->next!=NULL)
+    {
+        ((blockheader*)rest->next)->prev = rest;
+    }
+    if (returnPage->firstFree==block)
+    {
+        returnPage->firstFree = rest;
+    }
+    if (returnPage->lastFree==block)
+    {
+        returnPage->lastFree = rest;
+    }
+#if RM_POLICY == NEXT_FIT
+    rover = rest;
+#endif
+#ifdef RM_BOUNDARY_TAGS
+    rest->flags = PREV_USED;
+    FOOTER(rest) = rest->size;
+    block->size = size;
+    block->flags |= USED;
+#endif
+
+#ifdef RM_SEGREGATED
+    bin_insert(rest);
+#endif
+
+    return (void*)block;
+}
 
 
-    return;
-    
+void remove_block(blockheader* block)
+{
+    //takes a block off the free list
+    pageheader* page = (pageheader*)BASEADDR(block);
+
+    if (page->firstFree==block)
+    {
+        page->firstFree = (page->lastFree==block) ? NULL : block->next;
+    }
+    if (page->lastFree==block)
+    {
+        page->lastFree = (page->firstFree==NULL) ? NULL : block->prev;
+    }
+#if RM_POLICY == NEXT_FIT
+    if (rover==block)
+    {
+        rover = block->next;
+    }
+#endif
+
+    if (block->prev!=NULL)
+    {
+        ((blockheader*)block->prev)->next = block->next;
+    }
+    else
+    {
+        ((pageheader*)(globalPtr->ptr))->blockHead = block->next;
+    }
+    if (block->next!=NULL)
+    {
+        ((blockheader*)block->next)->prev = block->prev;
+    }
+
+#ifdef RM_SEGREGATED
+    bin_remove(block);
+#endif
 }
 
 
-void addToList(void* ptr,kma_size_t size)
+void kma_free(void* ptr, kma_size_t size)
 {
-  //  printf("adding %p of size %d\n",ptr,size);
-	//printf("global ptr %p-> %p\n",globalPtr,globalPtr->ptr);    
-blockheader* previous = NULL;
-    pageheader* pageHead;
-    //it's at the beginning of the list. make it point to the first free node
-    pageHead = (pageheader*) (globalPtr->ptr);
-    blockheader* current = pageHead->blockHead;
-    pageheader* currentPage = pageHead;
-    blockheader* newBlock;
-
-    newBlock = (blockheader*) ptr;  
-    newBlock->size = size; 
-    newBlock->next = NULL;
-	//printf("Adding\n");
-    //if the first one in the list. point to that one and return
-    if (current==NULL)
-    { 
-        pageHead->blockHead = newBlock;
+    if (adjustSize(size + TAG_SIZE) > PAGE_SIZE - sizeof(pageheader))
+    {
+        free_page(page_lookup(ptr));
         return;
     }
 
-   pageheader* cPage = (pageheader*)(((int)current>>13)<<13);
-   pageheader* pPage = (pageheader*)(((int)ptr>>13)<<13);
-   
-   if (pPage->pageid < cPage->pageid)
-{
-	//first free block is in a page after the one you're trying to free
-	newBlock->next = current;
-	pageHead->blockHead = newBlock;
-	return;
+#ifdef RM_BOUNDARY_TAGS
+    //the tag knows the real size of the block, merge it with its free
+    //neighbours and put the result on the free list unless the page is
+    //about to go away
+    blockheader* block = coalesce((blockheader*)(ptr - TAG_SIZE));
+    pageheader* decreasePage = (pageheader*)BASEADDR(block);
+    decreasePage->counter--;
+    if (decreasePage->counter==0)
+    {
+        assert((void*)block == (void*)decreasePage + sizeof(pageheader));
+        freeMyPage(decreasePage);
+        return;
+    }
+    addToList(block, block->size);
+#else
+    //first need to add the requested memory location to the free list
+    addToList(ptr,adjustSize(size));
+
+    //figure out what page we are decreasing from
+    pageheader* decreasePage = (pageheader*)BASEADDR(ptr);
+    decreasePage->counter--;
+    if (decreasePage->counter==0)
+    {
+        freeMyPage(decreasePage);
+    }
+#endif
 }
 
 
-    //if before the first entry in the list, add before and connect them
-    if ((void*)ptr<(void*)current)
+#ifdef RM_BOUNDARY_TAGS
+blockheader* coalesce(blockheader* block)
+{
+    //merges a block that is being freed with the blocks right before and
+    //after it if they are free. returns the merged block, which is not
+    //on the free list yet
+    pageheader* page = (pageheader*)BASEADDR(block);
+    blockheader* after = (blockheader*)((void*)block + block->size);
+
+    if ((void*)after < (void*)page + PAGE_SIZE && !(after->flags & USED))
     {
-        newBlock->next = current;
-        pageHead->blockHead = newBlock;
-        return;   
+        remove_block(after);
+        block->size += after->size;
     }
 
-    //ALL OTHER CASES
-    //go through the blocks and find a place to put it
-    bool inPage = FALSE;
-
-    //move through pages to find where the block belongs in the pages
-    while (((int)ptr >> 13) != ((int)currentPage >> 13))
+    if (!(block->flags & PREV_USED))
     {
-        if (currentPage->next == NULL) {break;}
-        currentPage = currentPage->next;
+        //the footer of the previous block sits right before this one
+        int previousSize = *(int*)((void*)block - sizeof(int));
+        blockheader* before = (blockheader*)((void*)block - previousSize);
+        remove_block(before);
+        before->size += block->size;
+        block = before;
     }
 
-    //now step through until you find out the block that you need
-    //we want to put the block in page currentPage
-    //current has the blockhead
-    while (current!=NULL)
+    return block;
+}
+#endif
+
+
+blockheader* findPredecessor(pageheader* page, void* ptr)
+{
+    //the free list is ordered by page (in page list order) and then by
+    //address within the page. if the page has free blocks, the new one
+    //goes somewhere around them
+    if (page->firstFree!=NULL && (void*)page->firstFree < ptr)
     {
-        if  (((int)current>>13) == ((int)ptr>>13) )
-        {
-            inPage = TRUE;
-            //pageVisited = TRUE;          
-        }
-	
-        pageheader* cPage = (pageheader*)(((int)current>>13)<<13);
-        pageheader* pPage = (pageheader*)(((int)ptr>>13)<<13);
-        //	printf("current: %p, ptr: %p\n",current,ptr);
-        //	printf("cpage %p, ppage %p \n ",cPage,pPage);
-        if (cPage->pageid > pPage->pageid)
+        blockheader* current = page->firstFree;
+        while (current!=page->lastFree && (void*)current->next < ptr)
         {
-            //current passed the page
-            break;
+            current = current->next;
         }
+        return current;
+    }
+    if (page->firstFree!=NULL)
+    {
+        return page->firstFree->prev;
+    }
 
-        if (inPage==TRUE)
-        {
-            //if it's inside the page and current ahead of ptr
-            if ((void*)current > (void*)ptr)
-            {
-                break;
-            }
-        }
+    //otherwise it goes after the last free block of an earlier page
+    pageheader* previousPage = page->prev;
+    while (previousPage!=NULL && previousPage->lastFree==NULL)
+    {
+        previousPage = previousPage->prev;
+    }
+    return (previousPage==NULL) ? NULL : previousPage->lastFree;
+}
 
-        //otherwise, just keep going through
-        previous = current;
-        current = current->next;
+
+void addToList(void* ptr,kma_size_t size)
+{
+    pageheader* pageHead = (pageheader*) (globalPtr->ptr);
+    pageheader* page = (pageheader*)BASEADDR(ptr);
+    blockheader* newBlock = (blockheader*) ptr;
+    blockheader* previous = findPredecessor(page, ptr);
+    blockheader* current;
+
+    newBlock->size = size;
+#ifdef RM_BOUNDARY_TAGS
+    //tag the block as free, the block after it now has a free neighbour
+    blockheader* after = (blockheader*)(ptr + size);
+    newBlock->flags &= PREV_USED;
+    FOOTER(newBlock) = size;
+    if ((void*)after < (void*)page + PAGE_SIZE)
+    {
+        after->flags &= ~PREV_USED;
     }
+#endif
 
-    if (current==NULL)
+    if (previous==NULL)
     {
-        newBlock->size = size;
-        newBlock->next = NULL;
-        previous->next = newBlock;
+        current = pageHead->blockHead;
+        pageHead->blockHead = newBlock;
     }
     else
     {
-        newBlock->next = current;
+        current = previous->next;
         previous->next = newBlock;
     }
-    //	printf("Added correctly\n");
-	return;
+    newBlock->next = current;
+    newBlock->prev = previous;
+    if (current!=NULL)
+    {
+        current->prev = newBlock;
+    }
+
+    //keep the page's own view of the list up to date
+    if (page->firstFree==NULL || ptr < (void*)page->firstFree)
+    {
+        page->firstFree = newBlock;
+    }
+    if (page->lastFree==NULL || ptr > (void*)page->lastFree)
+    {
+        page->lastFree = newBlock;
+    }
+
+#ifdef RM_SEGREGATED
+    bin_insert(newBlock);
+#endif
 }
 
+
 void freeMyPage(pageheader* page)
 {
-	//printf("Attempting to free page %p, %p\n",page,page->ptr);
-    //	printf("THIS IS REQUEST NUMBER %d\n", lineCounter);
-    pageheader* currentPage;
-    pageheader* previousPage = NULL;
-
-    currentPage = (pageheader*) (globalPtr->ptr);
-
-    blockheader* previous = NULL;
-    blockheader* current = currentPage->blockHead;
-
-    //it's at the beginning of the list. make it point to the first free node
-   
-	//printf("Before freeing the page the page list looks like this: \n");
-	pageheader* pageIterator = (pageheader*) (globalPtr->ptr);
-	while (pageIterator != NULL)
-	{
-	    //	printf("Addr: %p,%p, Ctr: %d -> ", pageIterator,pageIterator->ptr, pageIterator->counter);
-		pageIterator = pageIterator->next;
-	}
-	//printf("\n");
- 	
-
-    //
-    // if it's the first one to free
-    if (page==currentPage)
-    {
-        //if no more pages
-        if (currentPage->next==NULL)
+    pageheader* firstPage = (pageheader*) (globalPtr->ptr);
+
+    //the free blocks of the page are next to each other in the list,
+    //take them all off the list. with boundary tags they have all been
+    //merged and taken off already
+    while (page->firstFree!=NULL)
+    {
+        remove_block(page->firstFree);
+    }
+
+    //now unlink the page itself
+    if (page->prev!=NULL)
+    {
+        ((pageheader*)page->prev)->next = page->next;
+    }
+    if (page->next!=NULL)
+    {
+        ((pageheader*)page->next)->prev = page->prev;
+    }
+    if (page==tailPage)
+    {
+        tailPage = page->prev;
+    }
+
+    if (page==firstPage)
+    {
+        //the next page becomes the first one and takes over the list
+        pageheader* nextPage = page->next;
+        if (nextPage==NULL)
         {
-            //you're done!
-	    //printf("freeing page %p",page);
-            globalPtr=NULL;
-		free_page((kma_page_t*)page->ptr);
-            return;
+            //no more pages, you're done!
+            globalPtr = NULL;
         }
         else
         {
-            //find the first node in a next page
-	     while (((void*)current > (void*)currentPage) && ((void*)current < (void*)((int)currentPage+PAGE_SIZE)))
-	     {
-		if (current->next==NULL) { break;}
-		current = current->next; 
-	     }
-         //   while (((void*)current < ((void*)((int)page+PAGE_SIZE))) && (current!=NULL))
-         //   {
-         //       current = current->next;
-         //   }
-
-            //current has the new first node
-            //and new first page is next page
-            //*((kma_page_t**)globalPtr->ptr) = page->next;
-            //globalPtr = (kma_page_t*)page->next;
-            
-            pageheader* nextPage = page->next;
+            nextPage->blockHead = page->blockHead;
             globalPtr = nextPage->ptr;
-	    globalPtr->ptr = nextPage;
-		nextPage->blockHead = current;
-            //printf("New head page is %p and block head at %p\n",globalPtr,nextPage->blockHead);
-		free_page(page->ptr);
-            return;
         }
     }
-    else 
+
+    free_page(page->ptr);
+}
+
+
+#ifdef RM_SEGREGATED
+int getBinIndex(kma_size_t size)
+{
+    //floor of log base 2
+    return 31 - __builtin_clz((unsigned int)size);
+}
+
+
+void bin_insert(blockheader* block)
+{
+    int index = getBinIndex(block->size);
+
+    block->binPrev = NULL;
+    block->binNext = bins[index];
+    if (bins[index]!=NULL)
     {
-        //not the first page
-        //find the previous page
-        pageheader* tempPage = (pageheader*)globalPtr->ptr;
-        while (tempPage!=page)
-        {
-            previousPage = tempPage;
-            tempPage = tempPage->next;
-        }
-        
-        if (page->next==NULL)
-        {
-            //the last one
-            while (!((void*)current > ((void*)page)) && ((void*)current<((void*)((int)page)+PAGE_SIZE)))
-            {
-                //step through until you find the first block in the page
-                previous = current;
-                current = current->next;
-            }
-            //now set next from there to null
-            previous->next = NULL;
-            //free the page
-	    previousPage->next = NULL;
-            free_page((kma_page_t*)page->ptr);
-            return;
-            
-        }
-        //not the last one
+        bins[index]->binPrev = block;
+    }
+    bins[index] = block;
+    binMask |= 1u << index;
+}
 
-        //linked them 
-        pageheader* nextPage = page->next;
-        previousPage->next = nextPage;
 
-        //now link the blocks
-        pageheader* cPage = (pageheader*)(((int)current>>13)<<13);
-        while(cPage->pageid <= page->pageid)
-        {
-            if (cPage->pageid < page->pageid)
-            {
-                //update previous as well
-                previous = current;
-            }
-            //update current
+void bin_remove(blockheader* block)
+{
+    int index = getBinIndex(block->size);
+
+    if (block->binPrev!=NULL)
+    {
+        ((blockheader*)block->binPrev)->binNext = block->binNext;
+    }
+    else
+    {
+        bins[index] = block->binNext;
+    }
+    if (block->binNext!=NULL)
+    {
+        ((blockheader*)block->binNext)->binPrev = block->binPrev;
+    }
+
+    if (bins[index]==NULL)
+    {
+        binMask &= ~(1u << index);
+    }
+}
 
-	    current = current->next;
-		if (current==NULL)
-{ break; }
-            cPage = (pageheader*)(((int)current>>13)<<13);
+
+blockheader* bin_search(kma_size_t size)
+{
+    int index = getBinIndex(size);
+
+    //every block in a bin above the one of size fits, and so does every
+    //block in the bin of size if size is a power of two
+    unsigned int fits = binMask & ~((1u << index) - 1);
+    if ((size & (size - 1)) != 0)
+    {
+        fits &= ~(1u << index);
+    }
+    if (fits!=0)
+    {
+        return bins[__builtin_ctz(fits)];
+    }
+
+    //otherwise only some blocks of the bin of size may fit
+    blockheader* current = bins[index];
+    while (current!=NULL)
+    {
+        if (current->size >= size)
+        {
+            return current;
         }
-        previous->next = current;
-        free_page((kma_page_t*)page->ptr);
-        return;
+        current = current->binNext;
     }
-    
+    return NULL;
 }
+#endif
 
 
 #endif // KMA_RM
@@ -0,0 +1,387 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Thread Cache
+ * -------------------------------------------------------------------------
+ *    Purpose: Per-thread magazines of small blocks in front of any of
+ *             the allocators, exchanged in batches with a shared depot
+ *    Author: bpv512, jjk612
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: bpv512,jjk612
+
+ ***************************************************************************/
+
+#ifdef KMA_TCACHE
+#define __KMA_IMPL__
+#define __KMA_TCACHE_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kma_tcache.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// a magazine of a class holds about this many bytes
+#define MAGAZINE_BYTES 32768
+
+// a stack of cached blocks of one class
+typedef struct magazine
+{
+  struct magazine* next;
+  int rounds;
+  void* round[TCACHE_ROUNDS];
+} magazine_t;
+
+// the two magazines a thread holds per class. blocks come from and go
+// to the loaded one, the previous one absorbs a refill or a drain
+typedef struct
+{
+  magazine_t* loaded;
+  magazine_t* previous;
+} tcache_class_t;
+
+// full magazines nobody holds
+typedef struct
+{
+  magazine_t* full;
+  int count;
+} depot_t;
+
+/************Global Variables*********************************************/
+
+// the backend, the depot and the empty magazines are only touched
+// under this lock
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static depot_t depot[TCACHE_CLASSES];
+static magazine_t* empty_magazines = NULL;
+
+static __thread tcache_class_t tcache[TCACHE_CLASSES];
+
+// gives the blocks of a thread back when it exits
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/************Function Prototypes******************************************/
+int sizeClass(kma_size_t);
+int classSize(int);
+int classRounds(int);
+void tcacheInit(int);
+int reload(int);
+void unload(int);
+void drain(magazine_t*, int);
+magazine_t* getMagazine();
+void putMagazine(magazine_t*);
+void flushThread(int);
+void tcacheExit(void*);
+void tcacheKey();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void* kma_malloc(kma_size_t size)
+{
+  magazine_t* mag;
+  int c;
+
+  if (size <= 0 || size > TCACHE_MAX)
+    {
+      void* ptr;
+
+      pthread_mutex_lock(&backend_lock);
+      ptr = kma_backend_malloc(size);
+      pthread_mutex_unlock(&backend_lock);
+      return ptr;
+    }
+
+  // the common case touches nothing but the thread's own magazine
+  c = sizeClass(size);
+  mag = tcache[c].loaded;
+  if (mag == NULL || mag->rounds == 0)
+    {
+      if (!reload(c))
+	{
+	  return NULL;
+	}
+      mag = tcache[c].loaded;
+    }
+
+  return mag->round[--mag->rounds];
+}
+
+void kma_free(void* ptr, kma_size_t size)
+{
+  magazine_t* mag;
+  int c;
+
+  if (size <= 0 || size > TCACHE_MAX)
+    {
+      pthread_mutex_lock(&backend_lock);
+      kma_backend_free(ptr, size);
+      pthread_mutex_unlock(&backend_lock);
+      return;
+    }
+
+  // the block was allocated with the size of its class, and any thread
+  // may cache it
+  c = sizeClass(size);
+  mag = tcache[c].loaded;
+  if (mag == NULL || mag->rounds == classRounds(c))
+    {
+      unload(c);
+      mag = tcache[c].loaded;
+    }
+
+  mag->round[mag->rounds++] = ptr;
+}
+
+void kma_tcache_flush()
+{
+  int c;
+
+  pthread_mutex_lock(&backend_lock);
+  flushThread(0);
+  for (c = 0; c < TCACHE_CLASSES; c++)
+    {
+      while (depot[c].full != NULL)
+	{
+	  magazine_t* mag = depot[c].full;
+
+	  depot[c].full = mag->next;
+	  drain(mag, c);
+	  putMagazine(mag);
+	}
+      depot[c].count = 0;
+    }
+  pthread_mutex_unlock(&backend_lock);
+}
+
+int sizeClass(kma_size_t size)
+{
+  int b;
+
+  if (size <= 128)
+    {
+      return (size + 15) / 16 - 1;
+    }
+
+  // 2^b < size <= 2^(b+1) falls in one of four steps of 2^(b-2)
+  b = 31 - __builtin_clz(size - 1);
+  return 8 + (b - 7) * 4 + ((size - 1) >> (b - 2)) - 4;
+}
+
+int classSize(int c)
+{
+  if (c < 8)
+    {
+      return (c + 1) * 16;
+    }
+
+  return (5 + (c - 8) % 4) << (5 + (c - 8) / 4);
+}
+
+int classRounds(int c)
+{
+  int rounds = MAGAZINE_BYTES / classSize(c);
+
+  if (rounds > TCACHE_ROUNDS)
+    {
+      return TCACHE_ROUNDS;
+    }
+  return rounds < 4 ? 4 : rounds;
+}
+
+void tcacheInit(int c)
+{
+  static __thread int registered = 0;
+
+  // called with the backend lock held
+  if (!registered)
+    {
+      pthread_once(&tcache_once, tcacheKey);
+      pthread_setspecific(tcache_key, tcache);
+      registered = 1;
+    }
+
+  tcache[c].loaded = getMagazine();
+  tcache[c].previous = getMagazine();
+}
+
+int reload(int c)
+{
+  tcache_class_t* tc = &tcache[c];
+  magazine_t* mag;
+
+  // the previous magazine is either full or empty, a full one is
+  // swapped in without the lock
+  if (tc->previous != NULL && tc->previous->rounds > 0)
+    {
+      mag = tc->loaded;
+      tc->loaded = tc->previous;
+      tc->previous = mag;
+      return 1;
+    }
+
+  pthread_mutex_lock(&backend_lock);
+  if (tc->loaded == NULL)
+    {
+      tcacheInit(c);
+    }
+
+  if (depot[c].full != NULL)
+    {
+      // trade the empty magazine for a full one
+      putMagazine(tc->loaded);
+      tc->loaded = depot[c].full;
+      depot[c].full = tc->loaded->next;
+      depot[c].count--;
+    }
+  else
+    {
+      // half a magazine from the backend, so a free right after does
+      // not have to go back
+      mag = tc->loaded;
+      while (mag->rounds < classRounds(c) / 2)
+	{
+	  void* ptr = kma_backend_malloc(classSize(c));
+
+	  if (ptr == NULL)
+	    {
+	      break;
+	    }
+	  mag->round[mag->rounds++] = ptr;
+	}
+    }
+  pthread_mutex_unlock(&backend_lock);
+
+  return tc->loaded->rounds > 0;
+}
+
+void unload(int c)
+{
+  tcache_class_t* tc = &tcache[c];
+  magazine_t* mag;
+
+  // the previous magazine has room unless it is full as well
+  if (tc->previous != NULL && tc->previous->rounds < classRounds(c))
+    {
+      mag = tc->loaded;
+      tc->loaded = tc->previous;
+      tc->previous = mag;
+      return;
+    }
+
+  pthread_mutex_lock(&backend_lock);
+  if (tc->loaded == NULL)
+    {
+      tcacheInit(c);
+      pthread_mutex_unlock(&backend_lock);
+      return;
+    }
+
+  // both are full. the previous one goes to the depot, or back to the
+  // backend once the depot holds enough of the class
+  mag = tc->previous;
+  if (depot[c].count < TCACHE_DEPOT)
+    {
+      mag->next = depot[c].full;
+      depot[c].full = mag;
+      depot[c].count++;
+      mag = getMagazine();
+    }
+  else
+    {
+      drain(mag, c);
+    }
+  tc->previous = tc->loaded;
+  tc->loaded = mag;
+  pthread_mutex_unlock(&backend_lock);
+}
+
+void drain(magazine_t* mag, int c)
+{
+  // called with the backend lock held
+  while (mag->rounds > 0)
+    {
+      kma_backend_free(mag->round[--mag->rounds], classSize(c));
+    }
+}
+
+magazine_t* getMagazine()
+{
+  magazine_t* mag = empty_magazines;
+
+  // called with the backend lock held
+  if (mag != NULL)
+    {
+      empty_magazines = mag->next;
+    }
+  else
+    {
+      mag = malloc(sizeof(magazine_t));
+      if (mag == NULL)
+	{
+	  error("unable to allocate a magazine", "");
+	}
+    }
+
+  mag->next = NULL;
+  mag->rounds = 0;
+  return mag;
+}
+
+void putMagazine(magazine_t* mag)
+{
+  assert(mag->rounds == 0);
+
+  mag->next = empty_magazines;
+  empty_magazines = mag;
+}
+
+void flushThread(int release)
+{
+  int c;
+
+  // called with the backend lock held. the magazines stay with the
+  // thread unless it is going away
+  for (c = 0; c < TCACHE_CLASSES; c++)
+    {
+      if (tcache[c].loaded == NULL)
+	{
+	  continue;
+	}
+      drain(tcache[c].loaded, c);
+      drain(tcache[c].previous, c);
+      if (release)
+	{
+	  putMagazine(tcache[c].loaded);
+	  putMagazine(tcache[c].previous);
+	  tcache[c].loaded = NULL;
+	  tcache[c].previous = NULL;
+	}
+    }
+}
+
+void tcacheExit(void* arg)
+{
+  pthread_mutex_lock(&backend_lock);
+  flushThread(1);
+  pthread_mutex_unlock(&backend_lock);
+}
+
+void tcacheKey()
+{
+  pthread_key_create(&tcache_key, tcacheExit);
+}
+
+#endif // KMA_TCACHE
@@ -0,0 +1,88 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Thread Cache
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the thread caching front end
+ *    Author: bpv512, jjk612
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: bpv512,jjk612
+
+ ***************************************************************************/
+
+#ifndef __KMA_TCACHE_H__
+#define __KMA_TCACHE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KMA_TCACHE_IMPL__
+#define EXTERN
+#else
+#define EXTERN extern
+#endif
+
+/* largest request served from the cache, larger ones go straight to
+ * the backend */
+#define TCACHE_MAX 4096
+
+/* size classes: 16 byte steps up to 128, then four per power of two */
+#define TCACHE_CLASSES 28
+
+/* most rounds in a magazine, fewer for large classes */
+#define TCACHE_ROUNDS 64
+
+/* full magazines the depot keeps per class before it gives rounds back
+ * to the backend */
+#define TCACHE_DEPOT 8
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Backend allocation
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_malloc() of the allocator built behind the cache.
+ *             kma.h renames it when the program is built with
+ *             -DKMA_TCACHE. It is only called under the backend lock
+ *    Input: the size
+ *    Output: the allocated memory or NULL on failure
+ ***********************************************************************/
+EXTERN void* kma_backend_malloc(kma_size_t);
+
+/***********************************************************************
+ *  Title: Backend free
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_free() of the allocator built behind the cache
+ *    Input: the pointer to the memory space, its size
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_backend_free(void*, kma_size_t);
+
+/***********************************************************************
+ *  Title: Flush the thread cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Give every block cached by the calling thread and the
+ *             depot back to the backend. Blocks cached by other threads
+ *             stay there until those threads exit
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_tcache_flush();
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_TCACHE_H__ */
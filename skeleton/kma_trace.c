@@ -0,0 +1,83 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Event Trace
+ * -------------------------------------------------------------------------
+ *    Purpose: Ring buffer of fixed size allocator event records
+ *    Author: bpv512, jjk612
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: bpv512,jjk612
+ 
+ ***************************************************************************/
+
+#ifdef KMA_TRACE
+#define __KMA_TRACE_IMPL__
+
+/************System include***********************************************/
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+static kma_trace_record_t trace_records[KMA_TRACE_RECORDS];
+
+// total number of records ever written, the next one goes to
+// trace_seq % KMA_TRACE_RECORDS
+static unsigned long trace_seq = 0;
+
+/************Function Prototypes******************************************/
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void kma_trace(kma_trace_event_t event, void* ptr, int size)
+{
+  // threads take their slots with an atomic add, a record may still be
+  // torn when the buffer wraps under a writer
+  unsigned long seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+  kma_trace_record_t* rec = &trace_records[seq & (KMA_TRACE_RECORDS - 1)];
+  
+  rec->seq = seq;
+  rec->ptr = ptr;
+  rec->size = size;
+  rec->event = event;
+}
+
+int kma_trace_dump(char* file)
+{
+  FILE* out = fopen(file, "wb");
+  unsigned long first = 0;
+  unsigned long i;
+  
+  if (out == NULL)
+    {
+      return -1;
+    }
+  
+  // once the buffer wrapped only the last KMA_TRACE_RECORDS are left
+  if (trace_seq > KMA_TRACE_RECORDS)
+    {
+      first = trace_seq - KMA_TRACE_RECORDS;
+    }
+  
+  for (i = first; i < trace_seq; i++)
+    {
+      fwrite(&trace_records[i & (KMA_TRACE_RECORDS - 1)],
+	     sizeof(kma_trace_record_t), 1, out);
+    }
+  
+  fclose(out);
+  return trace_seq - first;
+}
+
+#endif // KMA_TRACE
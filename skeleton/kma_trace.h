@@ -0,0 +1,104 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator Event Trace
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the compile-time allocator event trace
+ *    Author: bpv512, jjk612
+ ***************************************************************************/
+
+/************************************************************************
+ Project Group: bpv512,jjk612
+ 
+ ***************************************************************************/
+
+#ifndef __KMA_TRACE_H__
+#define __KMA_TRACE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#undef EXTERN
+#ifdef __KMA_TRACE_IMPL__
+#define EXTERN 
+#else
+#define EXTERN extern
+#endif
+
+/* number of records kept, older records are overwritten.
+ * must be a power of two */
+#ifndef KMA_TRACE_RECORDS
+#define KMA_TRACE_RECORDS 65536
+#endif
+
+/* name of the binary file the records are dumped to */
+#define KMA_TRACE_FILE "kma_trace.bin"
+
+typedef enum
+{
+  TRACE_MALLOC,     /* ptr returned by kma_malloc, size requested */
+  TRACE_FREE,       /* ptr passed to kma_free, size freed */
+  TRACE_GET_PAGE,   /* page handed out by the page layer */
+  TRACE_FREE_PAGE,  /* page given back to the page layer */
+  TRACE_SPLIT,      /* block split, size of the halves */
+  TRACE_COALESCE,   /* block merged with its buddy, size of the result */
+  TRACE_SLACK       /* lazy buddy free, size is the slack of the class */
+} kma_trace_event_t;
+
+/* one fixed size binary record, written as is to the dump file */
+typedef struct
+{
+  unsigned long seq;
+  void*         ptr;
+  int           size;
+  int           event;
+} kma_trace_record_t;
+
+/***********************************************************************
+ *  Title: Trace event macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Record an allocator event. Compiles to nothing unless
+ *             the program is built with -DKMA_TRACE
+ *    Input: the event, the pointer and the size it applies to
+ *    Output: none
+ ***********************************************************************/
+#ifdef KMA_TRACE
+#define TRACE(event, ptr, size) kma_trace((event), (void*)(ptr), (size))
+#else
+#define TRACE(event, ptr, size) ((void)0)
+#endif
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Record a trace event
+ * ---------------------------------------------------------------------
+ *    Purpose: Append a record to the ring buffer, use TRACE() instead
+ *             of calling this directly
+ *    Input: the event, the pointer and the size it applies to
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_trace(kma_trace_event_t, void*, int);
+
+/***********************************************************************
+ *  Title: Dump the trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Write the buffered records, oldest first, to a file
+ *    Input: the file name
+ *    Output: the number of records written, or -1 on error
+ ***********************************************************************/
+EXTERN int kma_trace_dump(char*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_TRACE_H__ */
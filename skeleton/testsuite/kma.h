@@ -74,6 +74,13 @@
 
 typedef int kma_size_t;
 
+/* with -DKMA_TCACHE the thread cache in kma_tcache.c provides kma_malloc
+ * and kma_free, and the allocator built with it becomes its backend */
+#if defined(KMA_TCACHE) && defined(__KMA_IMPL__) && !defined(__KMA_TCACHE_IMPL__)
+#define kma_malloc kma_backend_malloc
+#define kma_free kma_backend_free
+#endif
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/